@@ -0,0 +1,145 @@
+#!/usr/bin/env lua
+
+local table = require( "table.n" )
+
+local N = tonumber( arg and arg[ 1 ] ) or 100000
+
+-- the same operation is timed on a plain table and on a table with an
+-- (empty) metatable, which forces the metamethod-honouring code path
+local function plain( t ) return t end
+local function proxied( t ) return setmetatable( t, {} ) end
+
+local function array( n, wrap )
+  local t = { n = n }
+  for i = 1, n do t[ i ] = (i * 7919) % n end
+  return wrap( t )
+end
+
+-- 'setup' prepares the input (untimed) and returns the function to
+-- time; the best of several runs is taken to reduce noise
+local function time( setup, wrap )
+  local best = math.huge
+  for _ = 1, 5 do
+    local f = setup( wrap )
+    collectgarbage()
+    local c = os.clock()
+    f()
+    local d = os.clock() - c
+    if d < best then best = d end
+  end
+  return best
+end
+
+local function bench( name, setup )
+  local a = time( setup, plain )
+  local b = time( setup, proxied )
+  print( ("%-10s %9.3fs %9.3fs %7.2fx"):format( name, a, b, b/a ) )
+end
+
+
+print( ("%-10s %10s %10s %8s"):format( "function", "raw", "metatable",
+                                       "speedup" ) )
+
+bench( "insert", function( wrap )
+  local t = array( 0, wrap )
+  return function()
+    for i = 1, N do table.insert( t, i ) end
+    for i = 1, 200 do table.insert( t, 1, i ) end
+  end
+end )
+
+bench( "remove", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 200 do table.remove( t, 1 ) end
+    for i = 1, t.n do table.remove( t ) end
+  end
+end )
+
+bench( "move", function( wrap )
+  local t, t2 = array( N, wrap ), array( 0, wrap )
+  return function()
+    for i = 1, 20 do
+      table.move( t, 1, N, 1, t2 )
+      table.move( t, 1, N-1, 2 )
+    end
+  end
+end )
+
+bench( "replace", function( wrap )
+  local t, t2 = array( N, wrap ), array( 10, wrap )
+  return function()
+    for i = 1, 100 do
+      table.replace( t, 2, 1, t2 )
+      table.replace( t, 2, 11, t2, 1, 0 )
+    end
+  end
+end )
+
+bench( "reverse", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 20 do table.reverse( t ) end
+  end
+end )
+
+bench( "rotate", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 10 do table.rotate( t, i ) end
+  end
+end )
+
+bench( "shuffle", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 10 do table.shuffle( t ) end
+  end
+end )
+
+bench( "sort", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    table.sort( t )
+  end
+end )
+
+bench( "sort/str", function( wrap )
+  local t = array( N, wrap )
+  for i = 1, N do t[ i ] = tostring( t[ i ] ) end
+  return function()
+    table.sort( t )
+  end
+end )
+
+bench( "concat", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 10 do table.concat( t, "," ) end
+  end
+end )
+
+bench( "unpack", function( wrap )
+  local t = array( 200, wrap )
+  return function()
+    for i = 1, N/10 do table.unpack( t ) end
+  end
+end )
+
+bench( "npairs", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 10 do
+      for _ in table.npairs( t ) do end
+    end
+  end
+end )
+
+bench( "npairs/fix", function( wrap )
+  local t = array( N, wrap )
+  return function()
+    for i = 1, 10 do
+      for _ in table.npairs( t, 1, true ) do end
+    end
+  end
+end )
@@ -10,8 +10,12 @@
 #include "lprefix.h"
 
 
+#include <errno.h>
 #include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "lua.h"
@@ -25,6 +29,9 @@
 /* conservative estimate: */
 #define LUA_MAXINTEGER INT_MAX
 #endif
+#ifndef LUA_MININTEGER
+#define LUA_MININTEGER (-LUA_MAXINTEGER-1)
+#endif
 
 
 /*
@@ -40,6 +47,59 @@
 #define aux_getn(L,n,w)	(checktab(L, n, w), check_n(L, n))
 
 
+/*
+** Element access that bypasses the metamethods when 'raw' is set
+** (see 'israw')
+*/
+#if LUA_VERSION_NUM >= 503
+#define aux_geti(L,t,i,raw) \
+  ((raw) ? (void)lua_rawgeti(L, t, i) : (void)lua_geti(L, t, i))
+#define aux_seti(L,t,i,raw) \
+  ((raw) ? (void)lua_rawseti(L, t, i) : (void)lua_seti(L, t, i))
+#else
+/* the raw functions take an 'int' index before Lua 5.3 */
+#define rawidx(i)	((i) >= INT_MIN && (i) <= INT_MAX)
+
+static void aux_geti (lua_State *L, int t, lua_Integer i, int raw) {
+  if (raw && rawidx(i))
+    lua_rawgeti(L, t, (int)i);
+  else
+    lua_geti(L, t, i);
+}
+
+static void aux_seti (lua_State *L, int t, lua_Integer i, int raw) {
+  if (raw && rawidx(i))
+    lua_rawseti(L, t, (int)i);
+  else
+    lua_seti(L, t, i);
+}
+#endif
+
+
+/*
+** All library functions share the (interned) string "n" as their
+** first upvalue, so accessing the '.n' field doesn't need to look up
+** the key string every time.
+*/
+#define NKEY	lua_upvalueindex(1)
+
+
+/*
+** Check whether 'arg' is a plain table without a metatable, in which
+** case 'lua_geti'/'lua_seti' would never call a metamethod anyway, so
+** the raw functions can be used instead.
+*/
+static int israw (lua_State *L, int arg) {
+  if (lua_type(L, arg) != LUA_TTABLE)
+    return 0;
+  if (lua_getmetatable(L, arg)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  return 1;
+}
+
+
 /*
 ** Get the .n field and make sure that it is a valid length.
 ** Return -1 if not.
@@ -47,7 +107,12 @@
 static lua_Integer get_n (lua_State *L, int n) {
   lua_Integer len = 0;
   int valid = 0;
-  lua_getfield(L, n, "n");
+  n = lua_absindex(L, n);
+  lua_pushvalue(L, NKEY);
+  if (israw(L, n))
+    lua_rawget(L, n);
+  else
+    lua_gettable(L, n);
   len = lua_tointegerx(L, -1, &valid);
   lua_pop(L, 1);
   if (!valid || len < 0)
@@ -67,6 +132,20 @@ static lua_Integer check_n (lua_State *L, int n) {
 }
 
 
+/*
+** Set the .n field to 'len'.
+*/
+static void set_n (lua_State *L, int n, lua_Integer len) {
+  n = lua_absindex(L, n);
+  lua_pushvalue(L, NKEY);
+  lua_pushinteger(L, len);
+  if (israw(L, n))
+    lua_rawset(L, n);
+  else
+    lua_settable(L, n);
+}
+
+
 static int checkfield (lua_State *L, const char *key, int n) {
   lua_pushstring(L, key);
   return (lua_rawget(L, -n) != LUA_TNIL);
@@ -92,381 +171,4983 @@ static void checktab (lua_State *L, int arg, int what) {
 }
 
 
-#if defined(LUA_COMPAT_MAXN)
-static int maxn (lua_State *L) {
-  lua_Number max = 0;
-  luaL_checktype(L, 1, LUA_TTABLE);
-  lua_pushnil(L);  /* first key */
-  while (lua_next(L, 1)) {
-    lua_pop(L, 1);  /* remove value */
-    if (lua_type(L, -1) == LUA_TNUMBER) {
-      lua_Number v = lua_tonumber(L, -1);
-      if (v > max) max = v;
-    }
-  }
-  lua_pushnumber(L, max);
-  return 1;
+/*
+** User values can only be tables before Lua 5.3, so other values are
+** wrapped in one there.
+*/
+#if LUA_VERSION_NUM >= 503
+#define setuvalue(L,i)	lua_setuservalue(L, i)
+#define getuvalue(L,i)	((void)lua_getuservalue(L, i))
+#else
+static void setuvalue (lua_State *L, int i) {
+  i = lua_absindex(L, i);
+  lua_createtable(L, 1, 0);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, i);
+}
+
+static void getuvalue (lua_State *L, int i) {
+  lua_getuservalue(L, i);
+  lua_rawgeti(L, -1, 1);
+  lua_remove(L, -2);
 }
 #endif
 
 
-static int tinsert (lua_State *L) {
-  lua_Integer e = aux_getn(L, 1, TAB_RW) + 1;  /* first empty element */
-  lua_Integer pos;  /* where to insert new element */
-  switch (lua_gettop(L)) {
-    case 2: {  /* called with only 2 arguments */
-      pos = e;  /* insert new element at the end */
-      lua_pushinteger(L, e);
-      lua_setfield(L, 1, "n"); /* set new length */
-      break;
-    }
-    case 3: {
-      lua_Integer i;
-      pos = luaL_checkinteger(L, 2);  /* 2nd argument is the position */
-      luaL_argcheck(L, 1 <= pos && pos <= e, 2, "position out of bounds");
-      lua_pushinteger(L, e);
-      lua_setfield(L, 1, "n"); /* set new length */
-      for (i = e; i > pos; i--) {  /* move up elements */
-        lua_geti(L, 1, i - 1);
-        lua_seti(L, 1, i);  /* t[i] = t[i - 1] */
-      }
-      break;
-    }
-    default: {
-      return luaL_error(L, "wrong number of arguments to 'insert'");
+/*
+** Does the number at index 'i' have the integer subtype? Before Lua
+** 5.3 there is none ('lua_isinteger' of compat-5.3 is true for all
+** floats with an integral value).
+*/
+#if LUA_VERSION_NUM >= 503
+#define isintsub(L,i)	lua_isinteger(L, i)
+#else
+#define isintsub(L,i)	0
+#endif
+
+
+/*
+** {======================================================
+** Deques
+** =======================================================
+*/
+
+/*
+** A deque is a userdata that stores its elements in a ring buffer:
+** the table 'store' (its user value) holds element 'i' at index
+** '(first + i - 1) % cap + 1'. Its metatable gives it the '.n'
+** protocol, so all other functions of this library work on it, and
+** 'table.insert'/'table.remove' push and pop at both ends in O(1).
+*/
+#define DEQUE		"table.n.deque"
+
+#define DQMINCAP	8
+#define DQMAXCAP	(INT_MAX / 2)
+
+typedef struct Deque {
+  lua_Integer first;  /* 0-based position of element 1 in the store */
+  lua_Integer n;  /* number of elements */
+  lua_Integer cap;  /* size of the store */
+} Deque;
+
+
+#define dqslot(d,i)	(((d)->first + (i) - 1) % (d)->cap + 1)
+
+
+static Deque *todeque (lua_State *L, int arg) {
+  return (Deque *)luaL_testudata(L, arg, DEQUE);
+}
+
+
+/*
+** Move the elements into a new store of size 'cap' (starting at
+** index 1 again).
+*/
+static void dqresize (lua_State *L, Deque *d, int ud, lua_Integer cap) {
+  lua_Integer i;
+  ud = lua_absindex(L, ud);
+  lua_getuservalue(L, ud);
+  lua_createtable(L, (int)cap, 0);
+  for (i = 1; i <= d->n; i++) {
+    lua_rawgeti(L, -2, dqslot(d, i));
+    lua_rawseti(L, -2, i);
+  }
+  lua_setuservalue(L, ud);
+  lua_pop(L, 1);
+  d->first = 0;
+  d->cap = cap;
+}
+
+
+/* make room for 'n' elements (doubling the store if necessary) */
+static void dqreserve (lua_State *L, Deque *d, int ud, lua_Integer n) {
+  if (n > d->cap) {
+    lua_Integer cap = d->cap;
+    if (n > DQMAXCAP)
+      luaL_error(L, "deque too big");
+    while (cap < n)
+      cap = (cap > DQMAXCAP / 2) ? DQMAXCAP : 2 * cap;
+    dqresize(L, d, ud, cap);
+  }
+}
+
+
+/* give memory back when the deque is mostly empty */
+static void dqshrink (lua_State *L, Deque *d, int ud) {
+  if (d->cap > DQMINCAP && d->n < d->cap / 4)
+    dqresize(L, d, ud, d->cap / 2);
+}
+
+
+/* push the value on top of the stack at the front or back */
+static void dqpush (lua_State *L, Deque *d, int ud, int front) {
+  lua_Integer slot;
+  dqreserve(L, d, ud, d->n + 1);
+  if (front) {
+    d->first = (d->first + d->cap - 1) % d->cap;
+    slot = d->first + 1;
+  }
+  else
+    slot = dqslot(d, d->n + 1);
+  d->n++;
+  lua_getuservalue(L, ud);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, slot);
+  lua_pop(L, 1);
+}
+
+
+/* pop the first or last element and push it */
+static void dqpop (lua_State *L, Deque *d, int ud, int front) {
+  lua_Integer slot;
+  if (d->n == 0) {
+    lua_pushnil(L);
+    return;
+  }
+  slot = dqslot(d, front ? 1 : d->n);
+  lua_getuservalue(L, ud);
+  lua_rawgeti(L, -1, slot);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, slot);
+  lua_remove(L, -2);
+  if (front)
+    d->first = (d->first + 1) % d->cap;
+  d->n--;
+  dqshrink(L, d, ud);
+}
+
+
+/* set the number of elements, adding nils or dropping elements */
+static void dqsetn (lua_State *L, Deque *d, int ud, lua_Integer n) {
+  if (n > d->n) {
+    dqreserve(L, d, ud, n);  /* new slots are nil already */
+    d->n = n;
+  }
+  else if (n < d->n) {
+    lua_getuservalue(L, ud);
+    for (; d->n > n; d->n--) {
+      lua_pushnil(L);
+      lua_rawseti(L, -2, dqslot(d, d->n));
     }
+    lua_pop(L, 1);
+    dqshrink(L, d, ud);
+  }
+}
+
+
+/* get the element index in the deque for key 'k' (0 if none) */
+static lua_Integer dqindex (lua_State *L, int k) {
+  if (lua_type(L, k) == LUA_TNUMBER) {
+    int isint = 0;
+    lua_Integer i = lua_tointegerx(L, k, &isint);
+    if (isint && i > 0)
+      return i;
   }
-  lua_seti(L, 1, pos);  /* t[pos] = v */
   return 0;
 }
 
 
-static int tremove (lua_State *L) {
-  lua_Integer size = aux_getn(L, 1, TAB_RW);
-  lua_Integer pos = luaL_optinteger(L, 2, size);
-  if (pos != size)  /* validate 'pos' if given */
-    luaL_argcheck(L, 1 <= pos && pos <= size + 1, 1, "position out of bounds");
-  lua_geti(L, 1, pos);  /* result = t[pos] */
-  for ( ; pos < size; pos++) {
-    lua_geti(L, 1, pos + 1);
-    lua_seti(L, 1, pos);  /* t[pos] = t[pos + 1] */
+static int dqget (lua_State *L) {
+  Deque *d = (Deque *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0) {
+    if (i > d->n)
+      return 0;
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, -1, dqslot(d, i));
   }
-  lua_pushnil(L);
-  lua_seti(L, 1, pos);  /* t[pos] = nil */
-  if (pos > 0 && pos <= size) {
-    lua_pushinteger(L, size-1);
-    lua_setfield(L, 1, "n");
+  else if (lua_rawequal(L, 2, NKEY))
+    lua_pushinteger(L, d->n);
+  else {  /* method */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(2));
   }
   return 1;
 }
 
 
 /*
-** Copy elements (1[f], ..., 1[e]) into (tt[t], tt[t+1], ...). Whenever
-** possible, copy in increasing order, which is better for rehashing.
-** "possible" means destination after original range, or smaller
-** than origin, or copying to another table.
+** Assigning to index 'n+1' appends to the deque. Indices beyond that
+** are rejected, because the gap would have to be allocated eagerly (a
+** plain table would only need a single hash slot); setting '.n'
+** explicitly extends the deque with nils.
 */
-static int tmove (lua_State *L) {
-  lua_Integer f = luaL_checkinteger(L, 2);
-  lua_Integer e = luaL_checkinteger(L, 3);
-  lua_Integer t = luaL_checkinteger(L, 4);
-  int tt = !lua_isnoneornil(L, 5) ? 5 : 1;  /* destination table */
-  checktab(L, 1, TAB_R);
-  checktab(L, tt, TAB_W);
-  if (e >= f) {  /* otherwise, nothing to move */
-    lua_Integer n, i;
-    lua_Integer size = get_n(L, tt);
-    luaL_argcheck(L, f > 0 || e < LUA_MAXINTEGER + f, 3,
-                  "too many elements to move");
-    n = e - f + 1;  /* number of elements to move */
-    luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
-                  "destination wrap around");
-    if (size >= 0 && t+n-1 > size) {
-      lua_pushinteger(L, t+n-1);
-      lua_setfield(L, tt, "n" );
-    }
-    if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
-      for (i = 0; i < n; i++) {
-        lua_geti(L, 1, f + i);
-        lua_seti(L, tt, t + i);
-      }
-    }
-    else {
-      for (i = n - 1; i >= 0; i--) {
-        lua_geti(L, 1, f + i);
-        lua_seti(L, tt, t + i);
-      }
+static int dqset (lua_State *L) {
+  Deque *d = (Deque *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0) {
+    if (i > d->n) {
+      if (lua_isnil(L, 3))
+        return 0;
+      luaL_argcheck(L, i == d->n + 1, 2, "deque index out of range");
+      dqsetn(L, d, 1, i);
     }
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, dqslot(d, i));
   }
-  lua_pushvalue(L, tt);  /* return destination table */
-  return 1;
+  else if (lua_rawequal(L, 2, NKEY)) {
+    lua_Integer n = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, n >= 0, 3, "invalid length");
+    dqsetn(L, d, 1, n);
+  }
+  else if (!lua_isnil(L, 3) || lua_type(L, 2) != LUA_TNUMBER)
+    return luaL_error(L, "invalid deque index");
+  return 0;
 }
 
 
-static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
-  lua_geti(L, 1, i);
-  if (!lua_isstring(L, -1))
-    luaL_error(L, "invalid value (%s) at index %d in table for 'concat'",
-                  luaL_typename(L, -1), i);
-  luaL_addvalue(b);
+static int dqlen (lua_State *L) {
+  lua_pushinteger(L, ((Deque *)lua_touserdata(L, 1))->n);
+  return 1;
 }
 
 
-static int tconcat (lua_State *L) {
-  luaL_Buffer b;
-  lua_Integer i, last;
-  size_t lsep;
-  const char *sep;
-  checktab(L, 1, TAB_R);
-  sep = luaL_optlstring(L, 2, "", &lsep);
-  i = luaL_optinteger(L, 3, 1);
-  last = luaL_opt(L, luaL_checkinteger, 4, check_n(L, 1));
-  luaL_buffinit(L, &b);
-  for (; i < last; i++) {
-    addfield(L, &b, i);
-    luaL_addlstring(&b, sep, lsep);
+/* d:push(...) appends the values, d:pushfront(...) prepends them */
+static int dqpushmany (lua_State *L, int front) {
+  Deque *d = (Deque *)luaL_checkudata(L, 1, DEQUE);
+  int i, top = lua_gettop(L);
+  for (i = 2; i <= top; i++) {
+    lua_pushvalue(L, front ? top + 2 - i : i);
+    dqpush(L, d, 1, front);
   }
-  if (i == last)  /* add last value (if interval was not empty) */
-    addfield(L, &b, i);
-  luaL_pushresult(&b);
+  return 0;
+}
+
+
+static int dqpushback (lua_State *L) {
+  return dqpushmany(L, 0);
+}
+
+
+static int dqpushfront (lua_State *L) {
+  return dqpushmany(L, 1);
+}
+
+
+static int dqpopback (lua_State *L) {
+  dqpop(L, (Deque *)luaL_checkudata(L, 1, DEQUE), 1, 0);
+  return 1;
+}
+
+
+static int dqpopfront (lua_State *L) {
+  dqpop(L, (Deque *)luaL_checkudata(L, 1, DEQUE), 1, 1);
   return 1;
 }
 
 
 /*
-** {======================================================
-** Pack/unpack
-** =======================================================
+** Create a deque (with the elements of the optional array 't').
 */
-
-static int pack (lua_State *L) {
-  int i;
-  int n = lua_gettop(L);  /* number of elements to pack */
-  lua_createtable(L, n, 1);  /* create result table */
-  lua_insert(L, 1);  /* put it at index 1 */
-  for (i = n; i >= 1; i--)  /* assign elements */
-    lua_seti(L, 1, i);
-  lua_pushinteger(L, n);
-  lua_setfield(L, 1, "n");  /* t.n = number of elements */
-  return 1;  /* return table */
+static int deque (lua_State *L) {
+  Deque *d;
+  lua_Integer i, n = 0, cap = DQMINCAP;
+  if (!lua_isnoneornil(L, 1)) {
+    n = aux_getn(L, 1, TAB_R);
+    luaL_argcheck(L, n <= DQMAXCAP, 1, "array too big");
+    while (cap < n)
+      cap *= 2;
+  }
+  d = (Deque *)lua_newuserdata(L, sizeof(Deque));
+  d->first = 0;
+  d->n = n;
+  d->cap = cap;
+  luaL_setmetatable(L, DEQUE);
+  lua_createtable(L, (int)cap, 0);
+  for (i = 1; i <= n; i++) {
+    aux_geti(L, 1, i, israw(L, 1));
+    lua_rawseti(L, -2, i);
+  }
+  lua_setuservalue(L, -2);
+  return 1;
 }
 
 
-static int unpack (lua_State *L) {
-  lua_Unsigned n;
-  lua_Integer i = luaL_optinteger(L, 2, 1);
-  lua_Integer e = luaL_opt(L, luaL_checkinteger, 3, aux_getn(L, 1, TAB_R));
-  if (i > e) return 0;  /* empty range */
-  n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
-  if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
-    return luaL_error(L, "too many results to unpack");
-  for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
-    lua_geti(L, 1, i);
-  }
-  lua_geti(L, 1, e);  /* push last element */
-  return (int)n;
+static const luaL_Reg deque_meta[] = {
+  {"__newindex", dqset},
+  {"__len", dqlen},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg deque_methods[] = {
+  {"push", dqpushback},
+  {"pop", dqpopback},
+  {"pushfront", dqpushfront},
+  {"popfront", dqpopfront},
+  {NULL, NULL}
+};
+
+
+/* create the metatable for deques (all functions get 'NKEY') */
+static void createdequemeta (lua_State *L) {
+  luaL_newmetatable(L, DEQUE);
+  lua_pushliteral(L, "n");
+  luaL_setfuncs(L, deque_meta, 1);
+  lua_pushliteral(L, "n");
+  lua_newtable(L);  /* methods */
+  luaL_setfuncs(L, deque_methods, 0);
+  lua_pushcclosure(L, dqget, 2);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
 }
 
 /* }====================================================== */
 
 
-
 /*
 ** {======================================================
-** Quicksort
-** (based on 'Algorithms in MODULA-3', Robert Sedgewick;
-**  Addison-Wesley, 1993.)
+** Typed arrays
 ** =======================================================
 */
 
+/*
+** A typed array is a userdata that keeps its elements unboxed in a
+** contiguous buffer (another userdata, kept as its user value). Like
+** deques, typed arrays follow the '.n' protocol, and some functions
+** of this library work on the buffer directly instead of going
+** through the metamethods.
+*/
+#define TYPED		"table.n.typed"
 
-/* type for array indices */
-typedef unsigned int IdxT;
+#define TY_F64		0	/* lua_Number */
+#define TY_I64		1	/* lua_Integer */
+#define TY_U8		2	/* integers in [0, 255] */
+#define TY_BOOL		3	/* booleans */
 
+static const char *const tynames[] = {"f64", "i64", "u8", "bool", NULL};
 
-/*
-** Produce a "random" 'unsigned int' to randomize pivot choice. This
-** macro is used only when 'sort' detects a big imbalance in the result
-** of a partition. (If you don't want/need this "randomness", ~0 is a
-** good choice.)
-*/
-#if !defined(l_randomizePivot)		/* { */
+#define TYMINCAP	8
 
-#include <time.h>
+typedef struct Typed {
+  int type;
+  size_t size;  /* size of an element */
+  lua_Integer n;  /* number of elements */
+  lua_Integer cap;  /* number of elements that fit into 'data' */
+  char *data;  /* contents of the buffer in the user value */
+} Typed;
 
-/* size of 'e' measured in number of 'unsigned int's */
-#define sof(e)		(sizeof(e) / sizeof(unsigned int))
 
-/*
-** Use 'time' and 'clock' as sources of "randomness". Because we don't
-** know the types 'clock_t' and 'time_t', we cannot cast them to
-** anything without risking overflows. A safe way to use their values
-** is to copy them to an array of a known type and use the array values.
-*/
-static unsigned int l_randomizePivot (void) {
-  clock_t c = clock();
-  time_t t = time(NULL);
-  unsigned int buff[sof(c) + sof(t)];
-  unsigned int i, rnd = 0;
-  memcpy(buff, &c, sof(c) * sizeof(unsigned int));
-  memcpy(buff + sof(c), &t, sof(t) * sizeof(unsigned int));
-  for (i = 0; i < sof(buff); i++)
-    rnd += buff[i];
-  return rnd;
-}
+#define tyelem(a,i)	((a)->data + (size_t)(i) * (a)->size)
 
-#endif					/* } */
 
+static Typed *totyped (lua_State *L, int arg) {
+  return (Typed *)luaL_testudata(L, arg, TYPED);
+}
 
-/* arrays larger than 'RANLIMIT' may use randomized pivots */
-#define RANLIMIT	100u
+
+/* make room for 'n' elements (doubling the buffer if necessary) */
+static void tyreserve (lua_State *L, Typed *a, int ud, lua_Integer n) {
+  if (n > a->cap) {
+    lua_Integer cap = a->cap;
+    lua_Integer max = (lua_Integer)(((size_t)-1 >> 2) / a->size);
+    char *data;
+    if (n > max)
+      luaL_error(L, "typed array too big");
+    while (cap < n)
+      cap = (cap > max / 2) ? max : 2 * cap;
+    ud = lua_absindex(L, ud);
+    data = (char *)lua_newuserdata(L, (size_t)cap * a->size);
+    memcpy(data, a->data, (size_t)a->n * a->size);
+    setuvalue(L, ud);
+    a->data = data;
+    a->cap = cap;
+  }
+}
 
 
-static void set2 (lua_State *L, IdxT i, IdxT j) {
-  lua_seti(L, 1, i);
-  lua_seti(L, 1, j);
+/* set the number of elements, new ones are zero (or false) */
+static void tysetn (lua_State *L, Typed *a, int ud, lua_Integer n) {
+  if (n > a->n) {
+    tyreserve(L, a, ud, n);
+    memset(tyelem(a, a->n), 0, (size_t)(n - a->n) * a->size);
+  }
+  a->n = n;
 }
 
 
-/*
+/* push element 'i' (0-based) */
+static void typush (lua_State *L, Typed *a, lua_Integer i) {
+  switch (a->type) {
+    case TY_F64: lua_pushnumber(L, ((lua_Number *)a->data)[i]); break;
+    case TY_I64: lua_pushinteger(L, ((lua_Integer *)a->data)[i]); break;
+    case TY_U8: lua_pushinteger(L, ((unsigned char *)a->data)[i]); break;
+    default: lua_pushboolean(L, ((unsigned char *)a->data)[i]); break;
+  }
+}
+
+
+/* raise an error if the value at 'idx' cannot be stored in 'a' */
+static void tycheck (lua_State *L, Typed *a, int idx) {
+  if (a->type == TY_BOOL || lua_isnil(L, idx))
+    return;
+  else if (lua_type(L, idx) != LUA_TNUMBER)
+    luaL_error(L, "invalid value (a %s) for '%s' array",
+               luaL_typename(L, idx), tynames[a->type]);
+  else if (a->type != TY_F64) {
+    int isint = 0;
+    lua_Integer v = lua_tointegerx(L, idx, &isint);
+    if (!isint || (a->type == TY_U8 && (v < 0 || v > 255)))
+      luaL_error(L, "invalid value (%s) for '%s' array",
+                 lua_tostring(L, idx), tynames[a->type]);
+  }
+}
+
+
+/*
+** Store the value at stack index 'idx' as element 'i' (0-based). A nil
+** stores zero (or false), so vacated elements are cleared.
+*/
+static void tystore (lua_State *L, Typed *a, lua_Integer i, int idx) {
+  tycheck(L, a, idx);
+  switch (a->type) {
+    case TY_F64:
+      ((lua_Number *)a->data)[i] = lua_tonumber(L, idx);
+      break;
+    case TY_I64:
+      ((lua_Integer *)a->data)[i] = lua_tointeger(L, idx);
+      break;
+    default:  /* u8 or bool */
+      ((unsigned char *)a->data)[i] = (unsigned char)
+        ((a->type == TY_U8) ? lua_tointeger(L, idx) : lua_toboolean(L, idx));
+      break;
+  }
+}
+
+
+#define tyswapas(T,a,i,j) \
+  { T *p_ = (T *)(a)->data; T t_ = p_[i]; p_[i] = p_[j]; p_[j] = t_; }
+
+/* swap the elements 'i' and 'j' (0-based) */
+static void tyswap (Typed *a, lua_Integer i, lua_Integer j) {
+  switch (a->type) {
+    case TY_F64: tyswapas(lua_Number, a, i, j); break;
+    case TY_I64: tyswapas(lua_Integer, a, i, j); break;
+    default: tyswapas(unsigned char, a, i, j); break;
+  }
+}
+
+
+/* reverse the elements 'i..j' (0-based) */
+static void tyreverse (Typed *a, lua_Integer i, lua_Integer j) {
+  for (; i < j; i++, j--)
+    tyswap(a, i, j);
+}
+
+
+static int tyget (lua_State *L) {
+  Typed *a = (Typed *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0 && i <= a->n)
+    typush(L, a, i - 1);
+  else if (lua_rawequal(L, 2, NKEY))
+    lua_pushinteger(L, a->n);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+/* (assignments beyond 'n' extend the array as for deques) */
+static int tyset (lua_State *L) {
+  Typed *a = (Typed *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0) {
+    if (i > a->n) {
+      if (lua_isnil(L, 3))
+        return 0;
+      luaL_argcheck(L, i == a->n + 1, 2, "typed array index out of range");
+      tycheck(L, a, 3);
+      tysetn(L, a, 1, i);
+    }
+    tystore(L, a, i - 1, 3);
+  }
+  else if (lua_rawequal(L, 2, NKEY)) {
+    lua_Integer n = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, n >= 0, 3, "invalid length");
+    tysetn(L, a, 1, n);
+  }
+  else if (!lua_isnil(L, 3) || lua_type(L, 2) != LUA_TNUMBER)
+    return luaL_error(L, "invalid typed array index");
+  return 0;
+}
+
+
+static int tylen (lua_State *L) {
+  lua_pushinteger(L, ((Typed *)lua_touserdata(L, 1))->n);
+  return 1;
+}
+
+
+/*
+** Create a typed array with 'n' zeros or with the elements of the
+** array 't'.
+*/
+static int typed (lua_State *L) {
+  static const size_t sizes[] = {
+    sizeof(lua_Number), sizeof(lua_Integer), 1, 1
+  };
+  int type = luaL_checkoption(L, 1, NULL, tynames);
+  lua_Integer i, n;
+  Typed *a;
+  int fromtab = !lua_isnoneornil(L, 2) && lua_type(L, 2) != LUA_TNUMBER;
+  if (fromtab)
+    n = aux_getn(L, 2, TAB_R);
+  else {
+    n = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, n >= 0, 2, "invalid length");
+  }
+  a = (Typed *)lua_newuserdata(L, sizeof(Typed));
+  a->type = type;
+  a->size = sizes[type];
+  a->n = 0;
+  a->cap = TYMINCAP;
+  a->data = (char *)lua_newuserdata(L, TYMINCAP * a->size);
+  setuvalue(L, -2);
+  luaL_setmetatable(L, TYPED);
+  tysetn(L, a, -1, n);
+  if (fromtab) {
+    int raw = israw(L, 2);
+    for (i = 1; i <= n; i++) {
+      aux_geti(L, 2, i, raw);
+      tystore(L, a, i - 1, -1);
+      lua_pop(L, 1);
+    }
+  }
+  return 1;
+}
+
+
+static const luaL_Reg typed_meta[] = {
+  {"__index", tyget},
+  {"__newindex", tyset},
+  {"__len", tylen},
+  {NULL, NULL}
+};
+
+
+/* create the metatable for typed arrays (all functions get 'NKEY') */
+static void createtypedmeta (lua_State *L) {
+  luaL_newmetatable(L, TYPED);
+  lua_pushliteral(L, "n");
+  luaL_setfuncs(L, typed_meta, 1);
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Slices
+** =======================================================
+*/
+
+/*
+** A slice is a view of the elements 'off+1..off+n' of its parent
+** array (its user value), so changes through the view are visible in
+** the parent and vice versa. A slice has a fixed length. Functions
+** that work on a range use 'unview' to go to the parent directly.
+*/
+#define VIEW		"table.n.slice"
+
+typedef struct View {
+  lua_Integer off;  /* index of the first element minus 1 */
+  lua_Integer n;  /* number of elements */
+} View;
+
+
+static View *toview (lua_State *L, int arg) {
+  return (View *)luaL_testudata(L, arg, VIEW);
+}
+
+
+/*
+** If 'arg' is a slice and the (non-empty) range 'i..j' lies inside it,
+** replace the slice by its parent and translate 'i' and 'j'.
+*/
+static void unview (lua_State *L, int arg, lua_Integer *i,
+                    lua_Integer *j) {
+  View *v = toview(L, arg);
+  if (v != NULL && 1 <= *i && *i <= *j && *j <= v->n) {
+    *i += v->off;
+    *j += v->off;
+    getuvalue(L, arg);
+    lua_replace(L, arg);
+  }
+}
+
+
+static int viewget (lua_State *L) {
+  View *v = (View *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0 && i <= v->n) {
+    getuvalue(L, 1);
+    lua_geti(L, -1, v->off + i);
+  }
+  else if (lua_rawequal(L, 2, NKEY))
+    lua_pushinteger(L, v->n);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+static int viewset (lua_State *L) {
+  View *v = (View *)lua_touserdata(L, 1);
+  lua_Integer i = dqindex(L, 2);
+  if (i > 0 && i <= v->n) {
+    getuvalue(L, 1);
+    lua_pushvalue(L, 3);
+    lua_seti(L, -2, v->off + i);
+  }
+  else if (lua_rawequal(L, 2, NKEY)) {
+    if (!lua_isinteger(L, 3) || lua_tointeger(L, 3) != v->n)
+      return luaL_error(L, "cannot change the length of a slice");
+  }
+  else if (!lua_isnil(L, 3) || lua_type(L, 2) != LUA_TNUMBER)
+    return luaL_error(L, "invalid slice index");
+  return 0;
+}
+
+
+static int viewlen (lua_State *L) {
+  lua_pushinteger(L, ((View *)lua_touserdata(L, 1))->n);
+  return 1;
+}
+
+
+/*
+** Create a view of 't[i..j]' (slices of slices refer to the original
+** parent).
+*/
+static int slice (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_opt(L, luaL_checkinteger, 3, n);
+  View *parent = toview(L, 1);
+  View *v;
+  luaL_argcheck(L, 1 <= i && i <= n + 1, 2, "position out of bounds");
+  luaL_argcheck(L, i - 1 <= j && j <= n, 3, "position out of bounds");
+  v = (View *)lua_newuserdata(L, sizeof(View));
+  v->off = i - 1;
+  v->n = j - i + 1;
+  if (parent != NULL) {
+    v->off += parent->off;
+    getuvalue(L, 1);
+  }
+  else
+    lua_pushvalue(L, 1);
+  setuvalue(L, -2);
+  luaL_setmetatable(L, VIEW);
+  return 1;
+}
+
+
+static const luaL_Reg view_meta[] = {
+  {"__index", viewget},
+  {"__newindex", viewset},
+  {"__len", viewlen},
+  {NULL, NULL}
+};
+
+
+/* create the metatable for slices (all functions get 'NKEY') */
+static void createviewmeta (lua_State *L) {
+  luaL_newmetatable(L, VIEW);
+  lua_pushliteral(L, "n");
+  luaL_setfuncs(L, view_meta, 1);
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Bulk transfers
+** =======================================================
+*/
+
+/*
+** Proxy objects may define '__getrange(obj, i, j)' (returning the
+** values 'obj[i..j]') and '__setrange(obj, i, v1, ..., vk)' (storing
+** them at 'obj[i..i+k-1]') in their metatable. Some functions then
+** transfer RANGEBLOCK elements per call instead of calling '__index'
+** or '__newindex' for every single element.
+*/
+#define RANGEBLOCK	64
+
+
+/* does the object at 'arg' have the metamethod 'event'? */
+static int hasrange (lua_State *L, int arg, const char *event) {
+  if (lua_type(L, arg) == LUA_TTABLE || lua_type(L, arg) == LUA_TUSERDATA) {
+    if (luaL_getmetafield(L, arg, event) != LUA_TNIL) {
+      lua_pop(L, 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* push the 'm' values 't[i..i+m-1]' */
+static void getblock (lua_State *L, int t, lua_Integer i, int m) {
+  int top = lua_gettop(L);
+  t = lua_absindex(L, t);
+  luaL_checkstack(L, m + 3, "too many elements");
+  if (luaL_getmetafield(L, t, "__getrange") != LUA_TNIL) {
+    lua_pushvalue(L, t);
+    lua_pushinteger(L, i);
+    lua_pushinteger(L, i + m - 1);
+    lua_call(L, 3, LUA_MULTRET);
+    lua_settop(L, top + m);  /* exactly 'm' values */
+  }
+  else {
+    int k, raw = israw(L, t);
+    for (k = 0; k < m; k++)
+      aux_geti(L, t, i + k, raw);
+  }
+}
+
+
+/* pop the top 'm' values and store them in 't[i..i+m-1]' */
+static void setblock (lua_State *L, int t, lua_Integer i, int m) {
+  t = lua_absindex(L, t);
+  luaL_checkstack(L, 2, "too many elements");
+  if (luaL_getmetafield(L, t, "__setrange") != LUA_TNIL) {
+    lua_insert(L, -m - 1);
+    lua_pushvalue(L, t);
+    lua_insert(L, -m - 1);
+    lua_pushinteger(L, i);
+    lua_insert(L, -m - 1);
+    lua_call(L, m + 2, 0);
+  }
+  else {
+    int k, raw = israw(L, t);
+    for (k = m - 1; k >= 0; k--)
+      aux_seti(L, t, i + k, raw);
+  }
+}
+
+
+/* is it worth to go through 'getblock'/'setblock'? */
+#define isbulk(L,src,dst) \
+  (hasrange(L, src, "__getrange") || hasrange(L, dst, "__setrange"))
+
+
+/*
+** Copy 'src[f..f+n-1]' to 'dst[t..t+n-1]' block by block, starting
+** with the last block if 'back' is set (for overlapping ranges).
+*/
+static void copyrange (lua_State *L, int src, lua_Integer f,
+                       lua_Integer n, int dst, lua_Integer t, int back) {
+  lua_Integer k;
+  for (k = 0; k < n; k += RANGEBLOCK) {
+    int m = (n - k < RANGEBLOCK) ? (int)(n - k) : RANGEBLOCK;
+    lua_Integer o = back ? n - k - m : k;
+    getblock(L, src, f + o, m);
+    setblock(L, dst, t + o, m);
+  }
+}
+
+
+/* set 't[i..i+n-1]' to nil */
+static void clearrange (lua_State *L, int t, lua_Integer i,
+                        lua_Integer n) {
+  lua_Integer k;
+  for (k = 0; k < n; k += RANGEBLOCK) {
+    int j, m = (n - k < RANGEBLOCK) ? (int)(n - k) : RANGEBLOCK;
+    luaL_checkstack(L, m, "too many elements");
+    for (j = 0; j < m; j++)
+      lua_pushnil(L);
+    setblock(L, t, i + k, m);
+  }
+}
+
+/* }====================================================== */
+
+
+
+#if defined(LUA_COMPAT_MAXN)
+static int maxn (lua_State *L) {
+  lua_Number max = 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushnil(L);  /* first key */
+  while (lua_next(L, 1)) {
+    lua_pop(L, 1);  /* remove value */
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      lua_Number v = lua_tonumber(L, -1);
+      if (v > max) max = v;
+    }
+  }
+  lua_pushnumber(L, max);
+  return 1;
+}
+#endif
+
+
+/*
+** Move the elements 't[from..len]' by 'd' positions: to the right for
+** a positive 'd' (filling the new slots at the end first, in increasing
+** order, which is better for rehashing), or to the left for a negative
+** 'd', in which case the '-d' slots at the end are set to nil.
+*/
+static void shift (lua_State *L, int t, lua_Integer from, lua_Integer len,
+                   lua_Integer d, int raw) {
+  lua_Integer i;
+  if (d != 0 && from <= len && isbulk(L, t, t)) {
+    copyrange(L, t, from, len - from + 1, t, from + d, d > 0);
+    if (d < 0)
+      clearrange(L, t, len + d + 1, -d);
+  }
+  else if (d > 0) {
+    lua_Integer first = (len - d + 1 > from) ? len - d + 1 : from;
+    for (i = first; i <= len; ++i) {  /* new slots */
+      aux_geti(L, t, i, raw);
+      aux_seti(L, t, i + d, raw);
+    }
+    for (i = first - 1; i >= from; --i) {
+      aux_geti(L, t, i, raw);
+      aux_seti(L, t, i + d, raw);
+    }
+  }
+  else if (d < 0) {
+    for (i = from; i <= len; ++i) {
+      aux_geti(L, t, i, raw);
+      aux_seti(L, t, i + d, raw);
+    }
+    for (i = len; i > len + d; --i) {
+      lua_pushnil(L);
+      aux_seti(L, t, i, raw);
+    }
+  }
+}
+
+
+static int tinsert (lua_State *L) {
+  lua_Integer e = aux_getn(L, 1, TAB_RW) + 1;  /* first empty element */
+  lua_Integer pos;  /* where to insert new element */
+  int raw = israw(L, 1);
+  Deque *d = todeque(L, 1);
+  Typed *a = totyped(L, 1);
+  int i, k = lua_gettop(L) - 2;  /* number of values to insert */
+  switch (lua_gettop(L)) {
+    case 0: case 1: {
+      return luaL_error(L, "wrong number of arguments to 'insert'");
+    }
+    case 2: {  /* called with only 2 arguments */
+      pos = e;  /* insert new element at the end */
+      k = 1;
+      break;
+    }
+    default: {  /* insert (several) values at a position */
+      pos = luaL_checkinteger(L, 2);  /* 2nd argument is the position */
+      luaL_argcheck(L, 1 <= pos && pos <= e, 2, "position out of bounds");
+      break;
+    }
+  }
+  if (d != NULL && k == 1 && (pos == 1 || pos == e)) {
+    dqpush(L, d, 1, pos == 1 && e > 1);  /* O(1) at both ends */
+    return 0;
+  }
+  if (a != NULL) {  /* move the tail with a single 'memmove' */
+    for (i = 0; i < k; i++)  /* (check all values before) */
+      tycheck(L, a, lua_gettop(L) - k + 1 + i);
+    tyreserve(L, a, 1, e - 1 + k);
+    memmove(tyelem(a, pos - 1 + k), tyelem(a, pos - 1),
+            (size_t)(e - pos) * a->size);
+    a->n = e - 1 + k;
+    for (i = 0; i < k; i++)
+      tystore(L, a, pos - 1 + i, lua_gettop(L) - k + 1 + i);
+    return 0;
+  }
+  set_n(L, 1, e - 1 + k);  /* set new length */
+  shift(L, 1, pos, e - 1, k, raw);  /* make room in one pass */
+  for (i = k - 1; i >= 0; i--)
+    aux_seti(L, 1, pos + i, raw);  /* t[pos + i] = v_i */
+  return 0;
+}
+
+
+/* remove 't[i..j]' and return the removed values */
+static int removerange (lua_State *L, lua_Integer size, lua_Integer i,
+                        lua_Integer j, int raw) {
+  lua_Integer k;
+  Typed *a;
+  luaL_argcheck(L, 1 <= i && i <= size + 1, 2, "position out of bounds");
+  luaL_argcheck(L, i - 1 <= j && j <= size, 3, "position out of bounds");
+  if (j - i >= INT_MAX || !lua_checkstack(L, (int)(j - i + 1)))
+    return luaL_error(L, "too many results to remove");
+  if ((a = totyped(L, 1)) != NULL) {
+    for (k = i; k <= j; k++)
+      typush(L, a, k - 1);
+    memmove(tyelem(a, i - 1), tyelem(a, j), (size_t)(size - j) * a->size);
+    a->n = size - (j - i + 1);
+    return (int)(j - i + 1);
+  }
+  for (k = i; k <= j; k++)  /* results */
+    aux_geti(L, 1, k, raw);
+  shift(L, 1, j + 1, size, i - j - 1, raw);  /* close the gap */
+  set_n(L, 1, size - (j - i + 1));
+  return (int)(j - i + 1);
+}
+
+
+static int tremove (lua_State *L) {
+  lua_Integer size = aux_getn(L, 1, TAB_RW);
+  lua_Integer pos = luaL_optinteger(L, 2, size);
+  int raw = israw(L, 1);
+  Deque *d = todeque(L, 1);
+  Typed *a = totyped(L, 1);
+  if (!lua_isnoneornil(L, 3))  /* range? */
+    return removerange(L, size, pos, luaL_checkinteger(L, 3), raw);
+  if (pos != size)  /* validate 'pos' if given */
+    luaL_argcheck(L, 1 <= pos && pos <= size + 1, 1, "position out of bounds");
+  if (d != NULL && size > 0 && (pos == 1 || pos == size)) {
+    dqpop(L, d, 1, pos == 1);  /* O(1) at both ends */
+    return 1;
+  }
+  if (a != NULL && 1 <= pos && pos <= size) {
+    typush(L, a, pos - 1);
+    memmove(tyelem(a, pos - 1), tyelem(a, pos),
+            (size_t)(size - pos) * a->size);
+    a->n = size - 1;
+    return 1;
+  }
+  aux_geti(L, 1, pos, raw);  /* result = t[pos] */
+  if (1 <= pos && pos < size && isbulk(L, 1, 1)) {
+    shift(L, 1, pos + 1, size, -1, raw);  /* also clears t[size] */
+    set_n(L, 1, size-1);
+    return 1;
+  }
+  for ( ; pos < size; pos++) {
+    aux_geti(L, 1, pos + 1, raw);
+    aux_seti(L, 1, pos, raw);  /* t[pos] = t[pos + 1] */
+  }
+  lua_pushnil(L);
+  aux_seti(L, 1, pos, raw);  /* t[pos] = nil */
+  if (pos > 0 && pos <= size)
+    set_n(L, 1, size-1);
+  return 1;
+}
+
+
+/*
+** 'table.move' between typed arrays of the same type (with a source
+** range inside the array) is a single 'memmove'.
+*/
+static int tymove (lua_State *L, lua_Integer f, lua_Integer n,
+                   lua_Integer t, int tt) {
+  Typed *a = totyped(L, 1), *b = totyped(L, tt);
+  if (a == NULL || b == NULL || a->type != b->type ||
+      f < 1 || f + n - 1 > a->n || t < 1)
+    return 0;
+  if (t + n - 1 > b->n)
+    tysetn(L, b, tt, t + n - 1);
+  memmove(tyelem(b, t - 1), tyelem(a, f - 1), (size_t)n * a->size);
+  return 1;
+}
+
+
+/*
+** Copy elements (1[f], ..., 1[e]) into (tt[t], tt[t+1], ...). Whenever
+** possible, copy in increasing order, which is better for rehashing.
+** "possible" means destination after original range, or smaller
+** than origin, or copying to another table.
+*/
+static int tmove (lua_State *L) {
+  lua_Integer f = luaL_checkinteger(L, 2);
+  lua_Integer e = luaL_checkinteger(L, 3);
+  lua_Integer t = luaL_checkinteger(L, 4);
+  int tt = !lua_isnoneornil(L, 5) ? 5 : 1;  /* destination table */
+  checktab(L, 1, TAB_R);
+  checktab(L, tt, TAB_W);
+  lua_settop(L, 5);
+  lua_pushvalue(L, tt);  /* result (a slice stays a slice) */
+  if (e >= f) {  /* otherwise, nothing to move */
+    lua_Integer n, i, last, size;
+    int raw, rawt;
+    luaL_argcheck(L, f > 0 || e < LUA_MAXINTEGER + f, 3,
+                  "too many elements to move");
+    n = e - f + 1;  /* number of elements to move */
+    luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
+                  "destination wrap around");
+    if (tt == 1 && toview(L, 1) != NULL) {  /* unview both separately */
+      lua_pushvalue(L, 1);
+      lua_replace(L, 5);
+      tt = 5;
+    }
+    last = t + n - 1;
+    unview(L, 1, &f, &e);
+    unview(L, tt, &t, &last);
+    if (tymove(L, f, n, t, tt))
+      return 1;
+    size = get_n(L, tt);
+    raw = israw(L, 1);
+    rawt = israw(L, tt);
+    if (size >= 0 && t+n-1 > size)
+      set_n(L, tt, t+n-1);
+    if (isbulk(L, 1, tt))
+      copyrange(L, 1, f, n, tt, t, !(t > e || t <= f ||
+                (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))));
+    else if (t > e || t <= f ||
+             (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
+      for (i = 0; i < n; i++) {
+        aux_geti(L, 1, f + i, raw);
+        aux_seti(L, tt, t + i, rawt);
+      }
+    }
+    else {
+      for (i = n - 1; i >= 0; i--) {
+        aux_geti(L, 1, f + i, raw);
+        aux_seti(L, tt, t + i, rawt);
+      }
+    }
+  }
+  return 1;  /* return destination table */
+}
+
+
+/* check that the value on top of the stack can be concatenated */
+static void checkconcat (lua_State *L, lua_Integer i, const char *fname) {
+  if (!lua_isstring(L, -1))
+    luaL_error(L, "invalid value (%s) at index %d in table for '%s'",
+                  luaL_typename(L, -1), (int)i, fname);
+}
+
+
+/*
+** Add 't[i]' to the buffer. For 'bulk' objects the elements are fetched
+** with 'getblock' into the scratch table at index 5, a block starting
+** at 'first' (and ending at 'last' at the latest) at a time.
+*/
+static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i,
+                      int raw, int bulk, lua_Integer first,
+                      lua_Integer last) {
+  if (bulk) {
+    int k = (int)((i - first) % RANGEBLOCK);
+    if (k == 0) {  /* fetch next block */
+      int m = (last - i < RANGEBLOCK) ? (int)(last - i + 1) : RANGEBLOCK;
+      getblock(L, 1, i, m);
+      for (; m > 0; m--)
+        lua_rawseti(L, 5, m);
+    }
+    lua_rawgeti(L, 5, k + 1);
+  }
+  else
+    aux_geti(L, 1, i, raw);
+  checkconcat(L, i, "concat");
+  luaL_addvalue(b);
+}
+
+
+/*
+** Numbers are formatted for 'concat' without creating a string for
+** every one of them, with the same results as 'lua_tolstring'.
+*/
+#define NUMBUFF		64	/* room for a formatted number */
+
+/* upper bound for the length of a float that is not an integer */
+#define FLTMAXLEN	32
+
+#if !defined(lua_getlocaledecpoint)
+#define lua_getlocaledecpoint()		(localeconv()->decimal_point[0])
+#endif
+
+
+static size_t intlen (lua_Integer v) {
+  lua_Unsigned u = (v < 0) ? 0u - (lua_Unsigned)v : (lua_Unsigned)v;
+  size_t l = (v < 0) ? 2 : 1;
+  for (; u >= 10; u /= 10)
+    l++;
+  return l;
+}
+
+
+static size_t fmtint (char *buff, lua_Integer v) {
+  char tmp[NUMBUFF];
+  char *p = tmp + NUMBUFF;
+  lua_Unsigned u = (v < 0) ? 0u - (lua_Unsigned)v : (lua_Unsigned)v;
+  size_t l;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (v < 0)
+    *--p = '-';
+  l = (size_t)(tmp + NUMBUFF - p);
+  memcpy(buff, p, l);
+  return l;
+}
+
+
+/*
+** Is 'x' an integer that LUA_NUMBER_FMT prints without a decimal
+** point or exponent (and not -0.0)? Then store it in '*v'.
+*/
+static int fltisint (lua_Number x, lua_Integer *v) {
+  if (-1e14 < x && x < 1e14 && x == floor(x) && (x != 0 || 1 / x > 0)) {
+    *v = (lua_Integer)x;
+    return (lua_Number)*v == x;
+  }
+  return 0;
+}
+
+
+/* length of the suffix (".0") for floats that look like integers */
+#if LUA_VERSION_NUM >= 503
+#define FLTSUFFIX	2
+#else
+#define FLTSUFFIX	0
+#endif
+
+
+static size_t fmtflt (char *buff, lua_Number x) {
+  lua_Integer v;
+  size_t l;
+  if (fltisint(x, &v))
+    l = fmtint(buff, v);
+  else {
+    l = (size_t)sprintf(buff, LUA_NUMBER_FMT, (LUAI_UACNUMBER)x);
+    if (buff[strspn(buff, "-0123456789")] != '\0')
+      return l;  /* has a decimal point, an exponent, or is inf/nan */
+  }
+  if (FLTSUFFIX) {
+    buff[l++] = lua_getlocaledecpoint();
+    buff[l++] = '0';
+  }
+  return l;
+}
+
+
+/* format the number at index 'idx' into 'buff' */
+static size_t fmtnum (lua_State *L, int idx, char *buff) {
+  if (isintsub(L, idx))
+    return fmtint(buff, lua_tointeger(L, idx));
+  return fmtflt(buff, lua_tonumber(L, idx));
+}
+
+
+/*
+** Size of 't[k]' (a string or number) in the result of 'concat'.
+** This is exact except for floats that are not integers, where it is
+** an upper bound (for the default number format).
+*/
+static size_t fieldlen (lua_State *L, lua_Integer k) {
+  size_t l;
+  lua_Integer v;
+  lua_rawgeti(L, 1, k);
+  if (lua_type(L, -1) == LUA_TSTRING)
+    l = lua_rawlen(L, -1);
+  else if (lua_type(L, -1) != LUA_TNUMBER) {
+    checkconcat(L, k, "concat");  /* raise an error */
+    l = 0;
+  }
+  else if (isintsub(L, -1))
+    l = intlen(lua_tointeger(L, -1));
+  else if (fltisint(lua_tonumber(L, -1), &v))
+    l = intlen(v) + FLTSUFFIX;
+  else
+    l = FLTMAXLEN;
+  lua_pop(L, 1);
+  return l;
+}
+
+
+/*
+** 'concat' for plain tables: a first pass computes the size of the
+** result, so the buffer is allocated only once, and numbers are
+** formatted directly into the buffer.
+*/
+static int rawconcat (lua_State *L, const char *sep, size_t lsep,
+                      lua_Integer i, lua_Integer last) {
+  luaL_Buffer b;
+  size_t total = 0;
+  lua_Integer k;
+  if (i <= last) {
+    for (k = i; ; k++) {
+      size_t l = fieldlen(L, k);
+      if (l > ((size_t)-1 >> 1) - total - lsep)
+        return luaL_error(L, "resulting string too large");
+      total += l;
+      if (k == last)
+        break;  /* (avoids overflows) */
+      total += lsep;
+    }
+  }
+  luaL_buffinitsize(L, &b, total);
+  for (k = i; k <= last; k++) {
+    lua_rawgeti(L, 1, k);
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      char buff[NUMBUFF];
+      size_t l = fmtnum(L, -1, buff);
+      lua_pop(L, 1);  /* (before using the buffer again) */
+      luaL_addlstring(&b, buff, l);
+    }
+    else
+      luaL_addvalue(&b);
+    if (k == last)
+      break;
+    luaL_addlstring(&b, sep, lsep);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int tconcat (lua_State *L) {
+  luaL_Buffer b;
+  lua_Integer i, first, last;
+  size_t lsep;
+  const char *sep;
+  int raw, bulk;
+  checktab(L, 1, TAB_R);
+  sep = luaL_optlstring(L, 2, "", &lsep);
+  i = luaL_optinteger(L, 3, 1);
+  last = luaL_opt(L, luaL_checkinteger, 4, check_n(L, 1));
+  unview(L, 1, &i, &last);
+  raw = israw(L, 1);
+  if (raw)
+    return rawconcat(L, sep, lsep, i, last);
+  first = i;
+  bulk = hasrange(L, 1, "__getrange");
+  if (bulk) {
+    lua_settop(L, 4);
+    lua_createtable(L, RANGEBLOCK, 0);  /* scratch table (index 5) */
+  }
+  luaL_buffinit(L, &b);
+  for (; i < last; i++) {
+    addfield(L, &b, i, raw, bulk, first, last);
+    luaL_addlstring(&b, sep, lsep);
+  }
+  if (i == last)  /* add last value (if interval was not empty) */
+    addfield(L, &b, i, raw, bulk, first, last);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Pack/unpack
+** =======================================================
+*/
+
+static int pack (lua_State *L) {
+  int i;
+  int n = lua_gettop(L);  /* number of elements to pack */
+  lua_createtable(L, n, 1);  /* create result table */
+  lua_insert(L, 1);  /* put it at index 1 */
+  for (i = n; i >= 1; i--)  /* assign elements */
+    lua_rawseti(L, 1, i);
+  set_n(L, 1, n);  /* t.n = number of elements */
+  return 1;  /* return table */
+}
+
+
+/*
+** Like 'pack', but stores the values in the given table (clearing
+** elements beyond the new 'n'), so no table has to be allocated. 'n'
+** is set first, as deques and typed arrays only grow at their end.
+*/
+static int pack_into (lua_State *L) {
+  int i, raw;
+  int n = lua_gettop(L) - 1;  /* number of elements to pack */
+  lua_Integer oldn;
+  checktab(L, 1, TAB_RW);
+  raw = israw(L, 1);
+  oldn = get_n(L, 1);
+  set_n(L, 1, n);  /* t.n = number of elements */
+  for (i = n; i >= 1; i--)  /* assign elements */
+    aux_seti(L, 1, i, raw);
+  for (; oldn > n; oldn--) {  /* clear stale elements */
+    lua_pushnil(L);
+    aux_seti(L, 1, oldn, raw);
+  }
+  return 1;  /* return table */
+}
+
+
+static int unpack (lua_State *L) {
+  lua_Unsigned n;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer e = luaL_opt(L, luaL_checkinteger, 3, aux_getn(L, 1, TAB_R));
+  int raw;
+  unview(L, 1, &i, &e);
+  raw = israw(L, 1);
+  if (i > e) return 0;  /* empty range */
+  n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
+  if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
+    return luaL_error(L, "too many results to unpack");
+  if (hasrange(L, 1, "__getrange")) {
+    getblock(L, 1, i, (int)n);  /* all in one call */
+    return (int)n;
+  }
+  for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
+    aux_geti(L, 1, i, raw);
+  }
+  aux_geti(L, 1, e, raw);  /* push last element */
+  return (int)n;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Native sorting of homogeneous arrays
+** =======================================================
+*/
+
+
+/* type for array indices */
+typedef unsigned int IdxT;
+
+
+/* kinds of arrays that can be sorted without calling back into Lua */
+#define NS_NONE	0
+#define NS_INT	1			/* only integers (and nils) */
+#define NS_FLT	2			/* only floats (and nils) */
+#define NS_STR	3			/* only strings (and nils) */
+
+
+/* arrays smaller than 'NATIVELIMIT' are not worth the setup */
+#define NATIVELIMIT	16u
+
+
+/*
+** Numbers are sorted as unsigned keys that compare in the same order
+** as the original values. This needs keys as wide as the values.
+*/
+typedef lua_Unsigned SortKey;
+
+#define KEYBITS		(sizeof(SortKey) * CHAR_BIT)
+#define KEYSIGN		((SortKey)1 << (KEYBITS - 1))
+#define INTKEYS		(sizeof(lua_Integer) == sizeof(SortKey))
+#define FLTKEYS		(sizeof(lua_Number) == sizeof(SortKey))
+
+
+static SortKey int2key (lua_Integer i) {
+  return (SortKey)i ^ KEYSIGN;
+}
+
+static lua_Integer key2int (SortKey k) {
+  return (lua_Integer)(k ^ KEYSIGN);
+}
+
+/* flip all bits of negative numbers, only the sign bit of the others */
+static SortKey flt2key (lua_Number f) {
+  SortKey k;
+  memcpy(&k, &f, sizeof(k));
+  return (k & KEYSIGN) ? ~k : (k | KEYSIGN);
+}
+
+static lua_Number key2flt (SortKey k) {
+  lua_Number f;
+  k = (k & KEYSIGN) ? (k ^ KEYSIGN) : ~k;
+  memcpy(&f, &k, sizeof(f));
+  return f;
+}
+
+
+static void keyinsertion (SortKey *a, size_t n) {
+  size_t i, j;
+  for (i = 1; i < n; i++) {
+    SortKey k = a[i];
+    for (j = i; j > 0 && k < a[j - 1]; j--)
+      a[j] = a[j - 1];
+    a[j] = k;
+  }
+}
+
+
+/*
+** LSD radix sort (one byte per pass) using 'tmp' as scratch space.
+** Passes where all keys have the same byte value are skipped.
+*/
+static void radixsort (SortKey *a, SortKey *tmp, size_t n) {
+  size_t count[sizeof(SortKey)][256];
+  SortKey *src = a, *dst = tmp;
+  size_t i;
+  unsigned int b;
+  if (n < 64) {
+    keyinsertion(a, n);
+    return;
+  }
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    SortKey k = a[i];
+    for (b = 0; b < sizeof(SortKey); b++)
+      count[b][(k >> (b * CHAR_BIT)) & 0xff]++;
+  }
+  for (b = 0; b < sizeof(SortKey); b++) {
+    unsigned int shift = b * CHAR_BIT;
+    size_t *c = count[b];
+    size_t sum = 0;
+    if (c[(src[0] >> shift) & 0xff] == n)
+      continue;  /* all keys share this byte */
+    for (i = 0; i < 256; i++) {  /* counts to offsets */
+      size_t t = c[i];
+      c[i] = sum;
+      sum += t;
+    }
+    for (i = 0; i < n; i++)
+      dst[c[(src[i] >> shift) & 0xff]++] = src[i];
+    { SortKey *t = src; src = dst; dst = t; }
+  }
+  if (src != a)
+    memcpy(a, src, n * sizeof(SortKey));
+}
+
+
+/* a numeric sort key and the position of its value in the array */
+typedef struct SortRec {
+  SortKey k;
+  IdxT i;
+} SortRec;
+
+
+static void recinsertion (SortRec *a, size_t n) {
+  size_t i, j;
+  for (i = 1; i < n; i++) {
+    SortRec r = a[i];
+    for (j = i; j > 0 && r.k < a[j - 1].k; j--)
+      a[j] = a[j - 1];
+    a[j] = r;
+  }
+}
+
+
+/*
+** Same as 'radixsort', but for records. As every LSD radix sort, it is
+** stable.
+*/
+static void recsort (SortRec *a, SortRec *tmp, size_t n) {
+  size_t count[sizeof(SortKey)][256];
+  SortRec *src = a, *dst = tmp;
+  size_t i;
+  unsigned int b;
+  if (n < 64) {
+    recinsertion(a, n);
+    return;
+  }
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {
+    SortKey k = a[i].k;
+    for (b = 0; b < sizeof(SortKey); b++)
+      count[b][(k >> (b * CHAR_BIT)) & 0xff]++;
+  }
+  for (b = 0; b < sizeof(SortKey); b++) {
+    unsigned int shift = b * CHAR_BIT;
+    size_t *c = count[b];
+    size_t sum = 0;
+    if (c[(src[0].k >> shift) & 0xff] == n)
+      continue;  /* all keys share this byte */
+    for (i = 0; i < 256; i++) {  /* counts to offsets */
+      size_t t = c[i];
+      c[i] = sum;
+      sum += t;
+    }
+    for (i = 0; i < n; i++)
+      dst[c[(src[i].k >> shift) & 0xff]++] = src[i];
+    { SortRec *t = src; src = dst; dst = t; }
+  }
+  if (src != a)
+    memcpy(a, src, n * sizeof(SortRec));
+}
+
+
+/* a string value and its original position in the array */
+typedef struct SortStr {
+  const char *s;
+  size_t l;
+  IdxT i;
+} SortStr;
+
+
+/*
+** Order strings like 'lua_compare' does: byte-wise if the collation
+** is "C" anyway ('coll' == 0), otherwise with 'strcoll', taking care
+** of embedded zeros (Lua strings always have a trailing '\0').
+*/
+static int strorder (const SortStr *a, const SortStr *b, int coll) {
+  if (!coll) {
+    int c = memcmp(a->s, b->s, a->l < b->l ? a->l : b->l);
+    return c != 0 ? c : (a->l > b->l) - (a->l < b->l);
+  }
+  else {
+    const char *l = a->s, *r = b->s;
+    size_t ll = a->l, lr = b->l;
+    for (;;) {
+      int c = strcoll(l, r);
+      if (c != 0)
+        return c;
+      else {
+        size_t len = strlen(l);
+        if (len == lr)
+          return (len == ll) ? 0 : 1;
+        else if (len == ll)
+          return -1;
+        len++;
+        l += len; ll -= len; r += len; lr -= len;
+      }
+    }
+  }
+}
+
+
+static int usecoll (void) {
+  const char *loc = setlocale(LC_COLLATE, NULL);
+  return loc != NULL && strcmp(loc, "C") != 0 && strcmp(loc, "POSIX") != 0;
+}
+
+
+/* runs of this size are sorted by insertion sort before merging */
+#define STRRUN	16u
+
+/*
+** Stable merge sort of string records using 'tmp' as scratch space.
+*/
+static void strsort (SortStr *a, SortStr *tmp, size_t n, int coll) {
+  SortStr *src = a, *dst = tmp;
+  size_t lo, w;
+  for (lo = 0; lo < n; lo += STRRUN) {  /* sort short runs */
+    size_t up = (lo + STRRUN < n) ? lo + STRRUN : n;
+    size_t i, j;
+    for (i = lo + 1; i < up; i++) {
+      SortStr s = a[i];
+      for (j = i; j > lo && strorder(&s, &a[j - 1], coll) < 0; j--)
+        a[j] = a[j - 1];
+      a[j] = s;
+    }
+  }
+  for (w = STRRUN; w < n; w *= 2) {  /* merge runs */
+    for (lo = 0; lo < n; lo += 2 * w) {
+      size_t mid = (lo + w < n) ? lo + w : n;
+      size_t up = (mid + w < n) ? mid + w : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < up)
+        dst[k++] = (strorder(&src[j], &src[i], coll) < 0) ? src[j++]
+                                                          : src[i++];
+      while (i < mid) dst[k++] = src[i++];
+      while (j < up) dst[k++] = src[j++];
+    }
+    { SortStr *t = src; src = dst; dst = t; }
+  }
+  if (src != a)
+    memcpy(a, src, n * sizeof(SortStr));
+}
+
+
+/*
+** Sort the buffer 'a' of 'n' keys (or string records, for 'NS_STR')
+** using 'tmp' (of the same size) as scratch space.
+*/
+static void sortbuffer (int kind, void *a, void *tmp, size_t n, int coll) {
+  if (kind == NS_STR)
+    strsort((SortStr *)a, (SortStr *)tmp, n, coll);
+  else
+    radixsort((SortKey *)a, (SortKey *)tmp, n);
+}
+
+
+/*
+** {------------------------------------------------------
+** Parallel sorting of native buffers
+** -------------------------------------------------------
+*/
+#if defined(TABLE_N_USE_PTHREADS)	/* { */
+
+#include <pthread.h>
+
+/* maximal number of worker threads */
+#define MAXTHREADS	64
+
+/* minimal number of elements per worker thread */
+#define PARLIMIT	(1u << 15)
+
+
+/* a chunk to sort, or two adjacent sorted chunks to merge */
+typedef struct SortJob {
+  int kind;
+  int coll;
+  char *src, *dst;  /* chunk(s) and destination (or scratch space) */
+  size_t n1, n2;  /* sizes of the two chunks (n2 == 0 means sort) */
+  pthread_t thread;
+} SortJob;
+
+
+static void mergekeys (const SortKey *a, size_t na, const SortKey *b,
+                       size_t nb, SortKey *dst) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb)
+    dst[k++] = (b[j] < a[i]) ? b[j++] : a[i++];
+  while (i < na) dst[k++] = a[i++];
+  while (j < nb) dst[k++] = b[j++];
+}
+
+
+static void mergestrs (const SortStr *a, size_t na, const SortStr *b,
+                       size_t nb, SortStr *dst, int coll) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb)
+    dst[k++] = (strorder(&b[j], &a[i], coll) < 0) ? b[j++] : a[i++];
+  while (i < na) dst[k++] = a[i++];
+  while (j < nb) dst[k++] = b[j++];
+}
+
+
+static void *runjob (void *ud) {
+  SortJob *job = (SortJob *)ud;
+  if (job->n2 == 0)
+    sortbuffer(job->kind, job->src, job->dst, job->n1, job->coll);
+  else if (job->kind == NS_STR) {
+    SortStr *a = (SortStr *)job->src;
+    mergestrs(a, job->n1, a + job->n1, job->n2, (SortStr *)job->dst,
+              job->coll);
+  }
+  else {
+    SortKey *a = (SortKey *)job->src;
+    mergekeys(a, job->n1, a + job->n1, job->n2, (SortKey *)job->dst);
+  }
+  return NULL;
+}
+
+
+/*
+** Run all jobs, each in its own thread (the last one in the calling
+** thread). If a thread cannot be created its job is run directly.
+*/
+static void runjobs (SortJob *jobs, int njobs) {
+  int i, started[MAXTHREADS];
+  for (i = 0; i < njobs - 1; i++)
+    started[i] = (pthread_create(&jobs[i].thread, NULL, runjob,
+                                 &jobs[i]) == 0);
+  runjob(&jobs[njobs - 1]);
+  for (i = 0; i < njobs - 1; i++) {
+    if (started[i])
+      pthread_join(jobs[i].thread, NULL);
+    else
+      runjob(&jobs[i]);
+  }
+}
+
+
+/*
+** Sort 'a' with up to 'nthreads' threads: the chunks are sorted in
+** parallel and then merged pairwise (again in parallel), alternating
+** between 'a' and 'tmp'. Small arrays are sorted by the caller.
+*/
+static int parsortbuffer (int kind, void *a, void *tmp, size_t n,
+                          int coll, int nthreads) {
+  size_t esz = (kind == NS_STR) ? sizeof(SortStr) : sizeof(SortKey);
+  size_t bounds[MAXTHREADS + 1];
+  SortJob jobs[MAXTHREADS];
+  char *src = (char *)a, *dst = (char *)tmp;
+  int i, nruns;
+  if (nthreads > MAXTHREADS)
+    nthreads = MAXTHREADS;
+  if ((size_t)nthreads > n / PARLIMIT)
+    nthreads = (int)(n / PARLIMIT);
+  if (nthreads < 2)
+    return 0;
+  for (i = 0; i <= nthreads; i++)
+    bounds[i] = n / nthreads * i + (n % nthreads) * i / nthreads;
+  for (i = 0; i < nthreads; i++) {  /* sort chunks */
+    jobs[i].kind = kind;
+    jobs[i].coll = coll;
+    jobs[i].src = src + bounds[i] * esz;
+    jobs[i].dst = dst + bounds[i] * esz;
+    jobs[i].n1 = bounds[i + 1] - bounds[i];
+    jobs[i].n2 = 0;
+  }
+  runjobs(jobs, nthreads);
+  for (nruns = nthreads; nruns > 1; nruns = (nruns + 1) / 2) {
+    int njobs = 0;
+    for (i = 0; i + 1 < nruns; i += 2) {  /* merge pairs of runs */
+      SortJob *job = &jobs[njobs++];
+      job->kind = kind;
+      job->coll = coll;
+      job->src = src + bounds[i] * esz;
+      job->dst = dst + bounds[i] * esz;
+      job->n1 = bounds[i + 1] - bounds[i];
+      job->n2 = bounds[i + 2] - bounds[i + 1];
+    }
+    if (i < nruns)  /* odd run out? */
+      memcpy(dst + bounds[i] * esz, src + bounds[i] * esz,
+             (bounds[i + 1] - bounds[i]) * esz);
+    runjobs(jobs, njobs);
+    for (i = 0; 2 * i < nruns; i++)  /* merged runs */
+      bounds[i] = bounds[2 * i];
+    bounds[i] = n;
+    { char *t = src; src = dst; dst = t; }
+  }
+  if (src != (char *)a)
+    memcpy(a, src, n * esz);
+  return 1;
+}
+
+#else					/* }{ */
+
+#define parsortbuffer(kind,a,tmp,n,coll,nthreads)	((void)(nthreads), 0)
+
+#endif					/* } */
+/* }------------------------------------------------------ */
+
+
+/*
+** Rearrange 't[lo..lo+n-1]' so that 't[lo+k]' gets the old value of
+** 't[p[k]]', following the cycles of the permutation so that every
+** element is read and written only once. 'p' is destroyed.
+*/
+static void applyperm (lua_State *L, int t, int raw, IdxT *p,
+                       IdxT lo, IdxT n) {
+  IdxT k;
+  for (k = 0; k < n; k++) {
+    IdxT d = k;
+    if (p[k] == lo + k)
+      continue;  /* in place (or cycle already done) */
+    aux_geti(L, t, lo + k, raw);  /* save start of cycle */
+    for (;;) {
+      IdxT s = p[d];
+      p[d] = lo + d;  /* mark as done */
+      if (s == lo + k) {  /* end of cycle? */
+        aux_seti(L, t, lo + d, raw);
+        break;
+      }
+      aux_geti(L, t, s, raw);
+      aux_seti(L, t, lo + d, raw);
+      d = s - lo;
+    }
+  }
+}
+
+
+/*
+** Find out whether all non-nil values in 't[lo..up]' have the same
+** kind (counting nils in '*nils'). Strings are only accepted for plain
+** tables, because the sort keeps pointers to them that are only safe
+** while they are anchored in the table. For a 'stable' sort negative
+** zeros are rejected, because the float keys would order them before
+** (the equal) positive zeros.
+*/
+static int nativekind (lua_State *L, int t, int raw, IdxT lo, IdxT up,
+                       int stable, IdxT *nils) {
+  int kind = NS_NONE;
+  IdxT i;
+  *nils = 0;
+  for (i = lo; i <= up; i++) {
+    int k;
+    aux_geti(L, t, i, raw);
+    switch (lua_type(L, -1)) {
+      case LUA_TNIL:
+        (*nils)++;
+        lua_pop(L, 1);
+        continue;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, -1))
+          k = INTKEYS ? NS_INT : NS_NONE;
+        else {
+          lua_Number f = lua_tonumber(L, -1);
+          k = (FLTKEYS && f == f) ? NS_FLT : NS_NONE;  /* no NaNs */
+          if (stable && f == 0 && flt2key(f) != flt2key(0))
+            k = NS_NONE;
+        }
+        break;
+      case LUA_TSTRING:
+        k = raw ? NS_STR : NS_NONE;
+        break;
+      default:
+        k = NS_NONE;
+        break;
+    }
+    lua_pop(L, 1);
+    if (k == NS_NONE || (kind != NS_NONE && k != kind))
+      return NS_NONE;
+    kind = k;
+  }
+  return kind;
+}
+
+
+/*
+** Try to sort 't[lo..up]' (with the default order) in C: the values
+** are copied into a buffer, sorted there and written back, with nils
+** at the end (as 'sort_comp' does). The buffer is a userdata, so it
+** is collected even if a metamethod raises an error. Returns 0 (and
+** does nothing) if the array is not homogeneous. The Lua state is
+** only used by the calling thread, even if the sort itself uses up to
+** 'nthreads' threads. Equal values keep their order if 'stable' is
+** set (string records are merge sorted, and equal integers cannot be
+** told apart anyway).
+*/
+static int nativesort (lua_State *L, int t, int raw, IdxT lo, IdxT up,
+                       int nthreads, int stable) {
+  IdxT nils, n = up - lo + 1, m, i, k;
+  int kind = nativekind(L, t, raw, lo, up, stable, &nils);
+  if (kind == NS_NONE)
+    return 0;
+  m = n - nils;  /* number of non-nil values */
+  if (kind == NS_STR) {
+    SortStr *a = (SortStr *)lua_newuserdata(L, 2 * (size_t)m * sizeof(SortStr)
+                                               + (size_t)n * sizeof(IdxT));
+    IdxT *p = (IdxT *)(a + 2 * (size_t)m);
+    IdxT j = m;
+    int coll;
+    for (i = lo, k = 0; i <= up; i++) {
+      lua_rawgeti(L, t, i);
+      if (lua_isnil(L, -1))
+        p[j++] = i;  /* nils go to the end */
+      else {
+        a[k].s = lua_tolstring(L, -1, &a[k].l);
+        a[k++].i = i;
+      }
+      lua_pop(L, 1);
+    }
+    coll = usecoll();
+    if (!parsortbuffer(kind, a, a + m, m, coll, nthreads))
+      sortbuffer(kind, a, a + m, m, coll);
+    for (k = 0; k < m; k++)
+      p[k] = a[k].i;
+    applyperm(L, t, raw, p, lo, n);
+  }
+  else {
+    SortKey *a = (SortKey *)lua_newuserdata(L, 2 * (size_t)m
+                                               * sizeof(SortKey));
+    for (i = lo, k = 0; i <= up; i++) {
+      aux_geti(L, t, i, raw);
+      if (!lua_isnil(L, -1))
+        a[k++] = (kind == NS_INT) ? int2key(lua_tointeger(L, -1))
+                                  : flt2key(lua_tonumber(L, -1));
+      lua_pop(L, 1);
+    }
+    if (!parsortbuffer(kind, a, a + m, m, 0, nthreads))
+      sortbuffer(kind, a, a + m, m, 0);
+    for (k = 0; k < n; k++) {
+      if (k >= m)
+        lua_pushnil(L);
+      else if (kind == NS_INT)
+        lua_pushinteger(L, key2int(a[k]));
+      else
+        lua_pushnumber(L, key2flt(a[k]));
+      aux_seti(L, t, lo + k, raw);
+    }
+  }
+  lua_pop(L, 1);  /* remove buffer */
+  return 1;
+}
+
+
+/*
+** Sort 'a[lo..up]' of a typed array with the default order: bytes
+** with a counting sort, numbers like in 'nativesort' (and with the
+** same restrictions on NaNs and negative zeros). Returns 0 for arrays
+** that must be left to the generic sort (e.g. booleans, which raise
+** an error there).
+*/
+static int typedsort (lua_State *L, Typed *a, lua_Integer lo,
+                      lua_Integer up, int nthreads, int stable) {
+  size_t i, n = (size_t)(up - lo + 1);
+  if (lo < 1 || up > a->n)
+    return 0;
+  if (a->type == TY_U8) {
+    size_t count[256] = {0};
+    unsigned char *p = (unsigned char *)a->data + (lo - 1);
+    int v;
+    for (i = 0; i < n; i++)
+      count[p[i]]++;
+    for (v = 0; v < 256; v++) {
+      memset(p, v, count[v]);
+      p += count[v];
+    }
+  }
+  else if (a->type == TY_I64 && INTKEYS) {
+    lua_Integer *p = (lua_Integer *)a->data + (lo - 1);
+    SortKey *k = (SortKey *)lua_newuserdata(L, 2 * n * sizeof(SortKey));
+    for (i = 0; i < n; i++)
+      k[i] = int2key(p[i]);
+    if (!parsortbuffer(NS_INT, k, k + n, n, 0, nthreads))
+      sortbuffer(NS_INT, k, k + n, n, 0);
+    for (i = 0; i < n; i++)
+      p[i] = key2int(k[i]);
+    lua_pop(L, 1);
+  }
+  else if (a->type == TY_F64 && FLTKEYS) {
+    lua_Number *p = (lua_Number *)a->data + (lo - 1);
+    SortKey *k;
+    for (i = 0; i < n; i++) {
+      if (p[i] != p[i] || (stable && p[i] == 0 && flt2key(p[i]) != flt2key(0)))
+        return 0;
+    }
+    k = (SortKey *)lua_newuserdata(L, 2 * n * sizeof(SortKey));
+    for (i = 0; i < n; i++)
+      k[i] = flt2key(p[i]);
+    if (!parsortbuffer(NS_FLT, k, k + n, n, 0, nthreads))
+      sortbuffer(NS_FLT, k, k + n, n, 0);
+    for (i = 0; i < n; i++)
+      p[i] = key2flt(k[i]);
+    lua_pop(L, 1);
+  }
+  else
+    return 0;
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Sorting by keys
+** =======================================================
+*/
+
+
+/* does integer 'v' convert to a float without losing precision? */
+static int intfitsflt (lua_Integer v) {
+  lua_Number f = (lua_Number)v;
+  return INTKEYS && f >= -(lua_Number)KEYSIGN && f < (lua_Number)KEYSIGN &&
+         (lua_Integer)f == v;
+}
+
+
+/* what 'sortkeys' uses as key, besides the fields of a comparator spec */
+#define KEYFN		0		/* result of the key function */
+#define KEYSELF		(-1)		/* the element itself */
+
+
+/*
+** Compute a key for every element 't[q[i-1]]' for 'i' in '1..n' and
+** store the keys in a new table (pushed onto the stack). The key is
+** the result of the key function at index 2 ('field' is 'KEYFN'), the
+** element itself ('KEYSELF'), or the value of field number 'field' of
+** the comparator spec at index 2.
+** Returns the native kind of the keys (numbers of both subtypes count
+** as floats if that is exact), or 'NS_NONE' if they must be compared
+** with 'lua_compare'. '*m' gets the number of non-nil keys.
+*/
+static int sortkeys (lua_State *L, IdxT n, int raw, int field,
+                     const IdxT *q, IdxT *m) {
+  int ints = 0, flts = 0, strs = 0, others = 0, inexact = 0;
+  IdxT i;
+  lua_createtable(L, (int)n, 0);
+  *m = 0;
+  for (i = 1; i <= n; i++) {
+    if (field == KEYFN) {
+      lua_pushvalue(L, 2);
+      aux_geti(L, 1, q[i - 1], raw);
+      lua_call(L, 1, 1);
+    }
+    else {
+      aux_geti(L, 1, q[i - 1], raw);
+      if (field != KEYSELF && !lua_isnil(L, -1)) {
+        lua_rawgeti(L, 2, 2 * field - 1);  /* field key */
+        lua_gettable(L, -2);
+        lua_remove(L, -2);
+      }
+    }
+    switch (lua_type(L, -1)) {
+      case LUA_TNIL:
+        break;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, -1)) {
+          ints = 1;
+          inexact |= !intfitsflt(lua_tointeger(L, -1));
+        }
+        else {
+          lua_Number f = lua_tonumber(L, -1);
+          flts = 1;
+          others |= (f != f);  /* NaNs have no order */
+        }
+        (*m)++;
+        break;
+      case LUA_TSTRING:
+        strs = 1;
+        (*m)++;
+        break;
+      default:
+        others = 1;
+        (*m)++;
+        break;
+    }
+    lua_rawseti(L, -2, i);
+  }
+  if (others || (strs && (ints || flts)))
+    return NS_NONE;
+  else if (strs)
+    return NS_STR;
+  else if (flts)
+    return (FLTKEYS && !inexact) ? NS_FLT : NS_NONE;
+  else
+    return INTKEYS ? NS_INT : NS_NONE;
+}
+
+
+static int sort_comp (lua_State *L, int a, int b);  /* see Quicksort */
+
+
+/*
+** Is key number 'a' in table 'keys' less than key number 'b'? With
+** 'comp' set the keys are compared with the order of the sort.
+*/
+static int keyless (lua_State *L, int keys, int comp, IdxT a, IdxT b) {
+  int res;
+  lua_rawgeti(L, keys, a);
+  lua_rawgeti(L, keys, b);
+  res = comp ? sort_comp(L, -2, -1) : lua_compare(L, -2, -1, LUA_OPLT);
+  lua_pop(L, 2);
+  return res;
+}
+
+
+/*
+** Stable merge sort of the indices in 'a' by their keys in table
+** 'keys', for keys that cannot be sorted natively.
+*/
+static void keysort (lua_State *L, int keys, int comp, IdxT *a,
+                     IdxT *tmp, size_t n) {
+  IdxT *src = a, *dst = tmp;
+  size_t lo, w;
+  for (lo = 0; lo < n; lo += STRRUN) {  /* sort short runs */
+    size_t up = (lo + STRRUN < n) ? lo + STRRUN : n;
+    size_t i, j;
+    for (i = lo + 1; i < up; i++) {
+      IdxT x = a[i];
+      for (j = i; j > lo && keyless(L, keys, comp, x, a[j - 1]); j--)
+        a[j] = a[j - 1];
+      a[j] = x;
+    }
+  }
+  for (w = STRRUN; w < n; w *= 2) {  /* merge runs */
+    for (lo = 0; lo < n; lo += 2 * w) {
+      size_t mid = (lo + w < n) ? lo + w : n;
+      size_t up = (mid + w < n) ? mid + w : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < up)
+        dst[k++] = keyless(L, keys, comp, src[j], src[i]) ? src[j++]
+                                                          : src[i++];
+      while (i < mid) dst[k++] = src[i++];
+      while (j < up) dst[k++] = src[j++];
+    }
+    { IdxT *t = src; src = dst; dst = t; }
+  }
+  if (src != a)
+    memcpy(a, src, n * sizeof(IdxT));
+}
+
+
+/*
+** Reorder the permutation 'q' (of the indices of 't[1..n]') so that
+** the elements 't[q[0]], t[q[1]], ...' are sorted (stably) by their
+** keys (see 'sortkeys'). So the key function (or field) is evaluated
+** exactly once per element. The keys are sorted in a buffer, natively
+** if they are all numbers or all strings and 'comp' is not set
+** (otherwise they are compared with 'sort_comp'). Elements with a nil
+** key go to the end. For a descending sort the records are filled in
+** reverse order, which keeps equal keys in their original order after
+** the (stable) ascending sort is read backwards.
+*/
+static void keyorder (lua_State *L, IdxT n, int raw, int field,
+                      int desc, int comp, IdxT *q) {
+  int kind, keys;
+  size_t size;
+  IdxT i, m, k, j, *p;
+  void *a;
+  kind = sortkeys(L, n, raw, field, q, &m);
+  keys = lua_gettop(L);
+  if (comp)
+    kind = NS_NONE;
+  size = (kind == NS_STR) ? sizeof(SortStr) :
+         (kind == NS_NONE) ? sizeof(IdxT) : sizeof(SortRec);
+  a = lua_newuserdata(L, 2 * (size_t)m * size + (size_t)n * sizeof(IdxT));
+  p = (IdxT *)((char *)a + 2 * (size_t)m * size);
+  for (i = 1, k = 0, j = m; i <= n; i++) {
+    IdxT r = desc ? m - 1 - k : k;  /* record for this key */
+    lua_rawgeti(L, keys, i);
+    if (lua_isnil(L, -1))
+      p[j++] = i;  /* nils go to the end */
+    else {
+      switch (kind) {
+        case NS_INT:
+          ((SortRec *)a)[r].k = int2key(lua_tointeger(L, -1));
+          ((SortRec *)a)[r].i = i;
+          break;
+        case NS_FLT: {
+          lua_Number f = lua_tonumber(L, -1);
+          ((SortRec *)a)[r].k = flt2key(f == 0 ? 0 : f);  /* no -0.0 */
+          ((SortRec *)a)[r].i = i;
+          break;
+        }
+        case NS_STR:  /* anchored in the keys table */
+          ((SortStr *)a)[r].s = lua_tolstring(L, -1, &((SortStr *)a)[r].l);
+          ((SortStr *)a)[r].i = i;
+          break;
+        default:
+          ((IdxT *)a)[r] = i;
+          break;
+      }
+      k++;
+    }
+    lua_pop(L, 1);
+  }
+  switch (kind) {
+    case NS_STR:
+      strsort((SortStr *)a, (SortStr *)a + m, m, usecoll());
+      for (k = 0; k < m; k++)
+        p[desc ? m - 1 - k : k] = ((SortStr *)a)[k].i;
+      break;
+    case NS_NONE:
+      keysort(L, keys, comp, (IdxT *)a, (IdxT *)a + m, m);
+      for (k = 0; k < m; k++)
+        p[desc ? m - 1 - k : k] = ((IdxT *)a)[k];
+      break;
+    default:
+      recsort((SortRec *)a, (SortRec *)a + m, m);
+      for (k = 0; k < m; k++)
+        p[desc ? m - 1 - k : k] = ((SortRec *)a)[k].i;
+      break;
+  }
+  for (k = 0; k < n; k++)  /* positions to indices */
+    p[k] = q[p[k] - 1];
+  memcpy(q, p, (size_t)n * sizeof(IdxT));
+  lua_pop(L, 2);  /* remove keys and buffer */
+}
+
+
+/* push a buffer with the identity permutation of '1..n' */
+static IdxT *newperm (lua_State *L, IdxT n) {
+  IdxT *q = (IdxT *)lua_newuserdata(L, (size_t)n * sizeof(IdxT));
+  IdxT k;
+  for (k = 0; k < n; k++)
+    q[k] = k + 1;
+  return q;
+}
+
+
+/*
+** Push the permutation that sorts 't[1..n]' by the fields of the
+** comparator spec at index 2, with one stable sort by keys for each
+** field, starting with the last one.
+*/
+static IdxT *fieldorder (lua_State *L, IdxT n, int raw, int fields) {
+  IdxT *q = newperm(L, n);
+  for (; fields > 0; fields--) {
+    int desc;
+    lua_rawgeti(L, 2, 2 * fields);
+    desc = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    keyorder(L, n, raw, fields, desc, 0, q);
+  }
+  return q;
+}
+
+
+/*
+** The permutation is applied to 't' only at the end, so 't' is
+** unchanged if 'keyfn' or a comparison raises an error.
+*/
+static int sortby (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  int desc = lua_toboolean(L, 3);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (n > 1) {  /* non-trivial interval? */
+    int raw;
+    IdxT *q;
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    lua_settop(L, 2);
+    raw = israw(L, 1);
+    q = newperm(L, (IdxT)n);
+    keyorder(L, (IdxT)n, raw, KEYFN, desc, 0, q);
+    applyperm(L, 1, raw, q, 1, (IdxT)n);
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Quicksort
+** (based on 'Algorithms in MODULA-3', Robert Sedgewick;
+**  Addison-Wesley, 1993, and 'Pattern-defeating Quicksort',
+**  Orson R. L. Peters, 2021.)
+** =======================================================
+*/
+
+
+/*
+** Produce a "random" 'unsigned int' to randomize pivot choice. This
+** macro is used only when 'sort' detects a big imbalance in the result
+** of a partition. (If you don't want/need this "randomness", ~0 is a
+** good choice.)
+*/
+#if !defined(l_randomizePivot)		/* { */
+
+#include <time.h>
+
+/* size of 'e' measured in number of 'unsigned int's */
+#define sof(e)		(sizeof(e) / sizeof(unsigned int))
+
+/*
+** Use 'time' and 'clock' as sources of "randomness". Because we don't
+** know the types 'clock_t' and 'time_t', we cannot cast them to
+** anything without risking overflows. A safe way to use their values
+** is to copy them to an array of a known type and use the array values.
+*/
+static unsigned int l_randomizePivot (void) {
+  clock_t c = clock();
+  time_t t = time(NULL);
+  unsigned int buff[sof(c) + sof(t)];
+  unsigned int i, rnd = 0;
+  memcpy(buff, &c, sof(c) * sizeof(unsigned int));
+  memcpy(buff + sof(c), &t, sof(t) * sizeof(unsigned int));
+  for (i = 0; i < sof(buff); i++)
+    rnd += buff[i];
+  return rnd;
+}
+
+#endif					/* } */
+
+
+/* arrays larger than 'RANLIMIT' may use randomized pivots */
+#define RANLIMIT	100u
+
+/* ranges smaller than 'INSLIMIT' are sorted by insertion sort */
+#define INSLIMIT	16u
+
+/* ranges larger than 'NINLIMIT' use the median of three medians */
+#define NINLIMIT	128u
+
+/* maximal number of moves for an optimistic insertion sort */
+#define PARTIALLIMIT	8u
+
+
+static void set2 (lua_State *L, IdxT i, IdxT j, int raw) {
+  aux_seti(L, 1, i, raw);
+  aux_seti(L, 1, j, raw);
+}
+
+
+static void swap (lua_State *L, IdxT i, IdxT j, int raw) {
+  aux_geti(L, 1, i, raw);
+  aux_geti(L, 1, j, raw);
+  set2(L, i, j, raw);  /* a[i] = a[j]; a[j] = old a[i] */
+}
+
+
+/*
+** Compare the values at stack indices 'a' and 'b' (which are not nil)
+** by the fields listed in the (normalized) comparator spec at index 2:
+** a sequence of pairs of field key and 'desc' flag. Nil field values
+** are greater than all others, in both directions.
+*/
+static int spec_comp (lua_State *L, int a, int b) {
+  int i;
+  a = lua_absindex(L, a);
+  b = lua_absindex(L, b);
+  for (i = 1; ; i += 2) {
+    int res, desc;
+    lua_rawgeti(L, 2, i);  /* field key */
+    if (lua_isnil(L, -1)) {  /* all fields are equal? */
+      lua_pop(L, 1);
+      return 0;
+    }
+    lua_pushvalue(L, -1);
+    lua_gettable(L, a);
+    lua_pushvalue(L, -2);
+    lua_gettable(L, b);
+    lua_rawgeti(L, 2, i + 1);
+    desc = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (lua_isnil(L, -2) || lua_isnil(L, -1))
+      res = lua_isnil(L, -1) - lua_isnil(L, -2);
+    else if (lua_compare(L, -2, -1, LUA_OPLT))
+      res = desc ? -1 : 1;
+    else if (lua_compare(L, -1, -2, LUA_OPLT))
+      res = desc ? 1 : -1;
+    else
+      res = 0;
+    lua_pop(L, 3);
+    if (res != 0)
+      return res > 0;
+  }
+}
+
+
+/*
 ** Return true iff value at stack index 'a' is less than the value at
 ** index 'b' (according to the order of the sort).
 */
-static int sort_comp (lua_State *L, int a, int b) {
-  if (lua_isnil(L, 2))  /* no function? */
-    return (!lua_isnil(L, a)) &&
-           (lua_isnil(L, b) ||
-            lua_compare(L, a, b, LUA_OPLT));  /* a < b */
-  else {  /* function */
-    int res;
-    lua_pushvalue(L, 2);    /* push function */
-    lua_pushvalue(L, a-1);  /* -1 to compensate function */
-    lua_pushvalue(L, b-2);  /* -2 to compensate function and 'a' */
-    lua_call(L, 2, 1);      /* call function */
-    res = lua_toboolean(L, -1);  /* get result */
-    lua_pop(L, 1);          /* pop result */
-    return res;
+static int sort_comp (lua_State *L, int a, int b) {
+  if (lua_isnil(L, 2))  /* no function? */
+    return (!lua_isnil(L, a)) &&
+           (lua_isnil(L, b) ||
+            lua_compare(L, a, b, LUA_OPLT));  /* a < b */
+  else if (lua_istable(L, 2))  /* comparator spec? */
+    return (!lua_isnil(L, a)) &&
+           (lua_isnil(L, b) || spec_comp(L, a, b));
+  else {  /* function */
+    int res;
+    lua_pushvalue(L, 2);    /* push function */
+    lua_pushvalue(L, a-1);  /* -1 to compensate function */
+    lua_pushvalue(L, b-2);  /* -2 to compensate function and 'a' */
+    lua_call(L, 2, 1);      /* call function */
+    res = lua_toboolean(L, -1);  /* get result */
+    lua_pop(L, 1);          /* pop result */
+    return res;
+  }
+}
+
+
+static void invalidorder (lua_State *L) {
+  luaL_error(L, "invalid order function for sorting");
+}
+
+
+/* swap a[i] and a[j] if a[j] < a[i] */
+static void sort2 (lua_State *L, IdxT i, IdxT j, int raw) {
+  aux_geti(L, 1, i, raw);
+  aux_geti(L, 1, j, raw);
+  if (sort_comp(L, -1, -2))  /* a[j] < a[i]? */
+    set2(L, i, j, raw);
+  else
+    lua_pop(L, 2);
+}
+
+
+/* make a[i] <= a[j] <= a[k] */
+static void sort3 (lua_State *L, IdxT i, IdxT j, IdxT k, int raw) {
+  sort2(L, i, j, raw);
+  sort2(L, j, k, raw);
+  sort2(L, i, j, raw);
+}
+
+
+/*
+** Return the first index 'i' in [lo, up) such that 'x < a[i]' (or
+** 'up'), where 'x' is the value at the top of the stack. Equal
+** elements are skipped, which keeps insertions stable.
+*/
+static IdxT upperbound (lua_State *L, IdxT lo, IdxT up, int raw) {
+  while (lo < up) {
+    IdxT m = lo + (up - lo) / 2;
+    aux_geti(L, 1, m, raw);
+    if (sort_comp(L, -2, -1))  /* x < a[m]? */
+      up = m;
+    else
+      lo = m + 1;
+    lua_pop(L, 1);
+  }
+  return lo;
+}
+
+
+/*
+** Insert 'a[i]' into the sorted range 'a[lo..i-1]' (using a binary
+** search) and return the number of moved elements. All comparisons
+** are done before the array is modified, so an error in the order
+** function never leaves the array with missing elements.
+*/
+static IdxT insertone (lua_State *L, IdxT lo, IdxT i, int raw) {
+  IdxT pos, k;
+  aux_geti(L, 1, i, raw);  /* element to insert */
+  aux_geti(L, 1, i - 1, raw);
+  if (!sort_comp(L, -2, -1)) {  /* not a[i] < a[i-1]? */
+    lua_pop(L, 2);
+    return 0;  /* already in place */
+  }
+  lua_pop(L, 1);
+  pos = upperbound(L, lo, i - 1, raw);
+  for (k = i; k > pos; k--) {  /* move up elements */
+    aux_geti(L, 1, k - 1, raw);
+    aux_seti(L, 1, k, raw);
+  }
+  aux_seti(L, 1, pos, raw);
+  return i - pos;
+}
+
+
+/* binary insertion sort of 'a[lo..up]' where 'a[lo..start-1]' is sorted */
+static void binsort (lua_State *L, IdxT lo, IdxT start, IdxT up,
+                     int raw) {
+  for (; start <= up; start++)
+    (void)insertone(L, lo, start, raw);
+}
+
+
+/*
+** Insertion sort that gives up (returning 0) after more than
+** PARTIALLIMIT moves, but always leaves 'a[lo..up]' consistent.
+*/
+static int partialinsertion (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT i, moves = 0;
+  for (i = lo + 1; i <= up; i++) {
+    moves += insertone(L, lo, i, raw);
+    if (moves > PARTIALLIMIT)
+      return i == up;
+  }
+  return 1;
+}
+
+
+/* is a[i] < P? (with the pivot P at the top of the stack) */
+static int lesspivot (lua_State *L, IdxT i, int raw) {
+  int res;
+  aux_geti(L, 1, i, raw);
+  res = sort_comp(L, -1, -2);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/* is P < a[i]? (with the pivot P at the top of the stack) */
+static int pivotless (lua_State *L, IdxT i, int raw) {
+  int res;
+  aux_geti(L, 1, i, raw);
+  res = sort_comp(L, -2, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/*
+** Partition 'a[lo..up]' around the pivot P = a[lo], with an element
+** not less than P somewhere in 'a[lo+1..up]'. Elements equal to P may
+** end up on both sides. Pos-condition:
+** a[lo .. p - 1] < a[p] == P <= a[p + 1 .. up], returns 'p'.
+** '*done' is set if no elements had to be swapped.
+*/
+static IdxT partition (lua_State *L, IdxT lo, IdxT up, int raw,
+                       int *done) {
+  IdxT i = lo;  /* will be incremented before first use */
+  IdxT j = up + 1;  /* will be decremented before first use */
+  aux_geti(L, 1, lo, raw);  /* push pivot */
+  while (lesspivot(L, ++i, raw))  /* repeat ++i while a[i] < P */
+    if (i == up)  /* a[i] < P for all elements ?? */
+      invalidorder(L);
+  if (i - 1 == lo) {  /* no element < P so far? need to guard 'j' */
+    while (i < j && !lesspivot(L, --j, raw))
+      ;
+  }
+  else {  /* a[i - 1] < P stops the loop */
+    while (!lesspivot(L, --j, raw))
+      if (j == lo)  /* a[j] >= P for all elements ?? */
+        invalidorder(L);
+  }
+  *done = (i >= j);
+  /* loop invariant: a[lo + 1 .. i - 1] < P <= a[j + 1 .. up] */
+  while (i < j) {
+    swap(L, i, j, raw);
+    while (lesspivot(L, ++i, raw))
+      if (i == up)
+        invalidorder(L);
+    while (!lesspivot(L, --j, raw))
+      if (j == lo)
+        invalidorder(L);
+  }
+  lua_pop(L, 1);  /* remove pivot */
+  swap(L, lo, i - 1, raw);  /* put pivot into its final place */
+  return i - 1;
+}
+
+
+/*
+** Partition 'a[lo..up]' around the pivot P = a[lo], where P is not
+** greater than all elements in the range (which happens when P is
+** equal to the element just before the range, which is a previous
+** pivot). Elements equal to P go to the left, so that for many equal
+** keys a whole block of them is done at once. Pos-condition:
+** a[lo .. p - 1] <= a[p] == P < a[p + 1 .. up], returns 'p'.
+*/
+static IdxT partitionleft (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT i = lo;
+  IdxT j = up + 1;
+  aux_geti(L, 1, lo, raw);  /* push pivot */
+  while (pivotless(L, --j, raw))  /* repeat --j while P < a[j] */
+    if (j == lo)  /* P < P ?? */
+      invalidorder(L);
+  if (j == up) {  /* no element > P so far? need to guard 'i' */
+    while (i < j && !pivotless(L, ++i, raw))
+      ;
+  }
+  else {  /* P < a[j + 1] stops the loop */
+    while (!pivotless(L, ++i, raw))
+      if (i == up)
+        invalidorder(L);
+  }
+  while (i < j) {
+    swap(L, i, j, raw);
+    while (pivotless(L, --j, raw))
+      if (j == lo)
+        invalidorder(L);
+    while (!pivotless(L, ++i, raw))
+      if (i == up)
+        invalidorder(L);
+  }
+  lua_pop(L, 1);  /* remove pivot */
+  swap(L, lo, j, raw);
+  return j;
+}
+
+
+/*
+** Choose an element in the middle (2nd-3th quarters) of [lo,up]
+** "randomized" by 'rnd'
+*/
+static IdxT choosePivot (IdxT lo, IdxT up, unsigned int rnd) {
+  IdxT r4 = (up - lo) / 4;  /* range/4 */
+  IdxT p = rnd % (r4 * 2) + (lo + r4);
+  lua_assert(lo + r4 <= p && p <= up - r4);
+  return p;
+}
+
+
+/*
+** Put a good pivot into 'a[lo]', using the median of 'a[lo]', 'a[p]'
+** and 'a[up]' (or the median of three such medians for large ranges).
+** Afterwards there is an element not less than the pivot in
+** 'a[lo+1..up]'.
+*/
+static void selectpivot (lua_State *L, IdxT lo, IdxT up, unsigned int rnd,
+                         int raw) {
+  IdxT p;
+  if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
+    p = lo + (up - lo)/2;  /* middle element is a good pivot */
+  else  /* for larger intervals, it is worth a random pivot */
+    p = choosePivot(lo, up, rnd);
+  if (up - lo >= NINLIMIT) {
+    sort3(L, lo, p, up, raw);
+    sort3(L, lo + 1, p - 1, up - 1, raw);
+    sort3(L, lo + 2, p + 1, up - 2, raw);
+    sort3(L, p - 1, p, p + 1, raw);
+    swap(L, lo, p, raw);
+  }
+  else
+    sort3(L, p, lo, up, raw);  /* a[p] <= a[lo] <= a[up] */
+}
+
+
+static void siftdown (lua_State *L, IdxT lo, IdxT i, IdxT n, int raw) {
+  for (;;) {
+    IdxT c = 2 * i + 1;  /* left child */
+    if (c >= n)
+      return;
+    if (c + 1 < n) {  /* pick the larger child */
+      aux_geti(L, 1, lo + c, raw);
+      aux_geti(L, 1, lo + c + 1, raw);
+      if (sort_comp(L, -2, -1))
+        c++;
+      lua_pop(L, 2);
+    }
+    aux_geti(L, 1, lo + i, raw);
+    aux_geti(L, 1, lo + c, raw);
+    if (!sort_comp(L, -2, -1)) {  /* not a[i] < a[c]? */
+      lua_pop(L, 2);
+      return;
+    }
+    set2(L, lo + i, lo + c, raw);
+    i = c;
+  }
+}
+
+
+/* heapsort of 'a[lo..up]' (the fallback for bad pivots) */
+static void heapsort (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT n = up - lo + 1;
+  IdxT i = n / 2;
+  while (i > 0)
+    siftdown(L, lo, --i, n, raw);
+  while (--n > 0) {
+    swap(L, lo, lo + n, raw);
+    siftdown(L, lo, 0, n, raw);
+  }
+}
+
+
+/*
+** Pattern-defeating QuickSort (recursive function, see Orson Peters'
+** 'pdqsort'). Small ranges are insertion sorted. If the pivot is equal
+** to the element before the range ('leftmost' is false), the equal
+** elements are split off in one pass. Ranges that were already
+** partitioned get an optimistic insertion sort, and after too many
+** ('bad') unbalanced partitions the range is heapsorted, so the sort
+** is O(n log n) in the worst case.
+*/
+static void auxsort (lua_State *L, IdxT lo, IdxT up, unsigned int rnd,
+                     int bad, int leftmost, int raw) {
+  while (lo < up) {  /* loop for tail recursion */
+    IdxT p;  /* Pivot index */
+    IdxT n = up - lo + 1;  /* size of the range */
+    int done;
+    if (n < INSLIMIT) {
+      binsort(L, lo, lo + 1, up, raw);
+      return;
+    }
+    selectpivot(L, lo, up, rnd, raw);
+    if (!leftmost) {
+      int less;
+      aux_geti(L, 1, lo - 1, raw);
+      less = pivotless(L, lo, raw);  /* a[lo - 1] < P? */
+      lua_pop(L, 1);
+      if (!less) {  /* P == a[lo - 1]? */
+        lo = partitionleft(L, lo, up, raw) + 1;
+        continue;  /* no need to sort elements equal to P */
+      }
+    }
+    p = partition(L, lo, up, raw, &done);
+    /* a[lo .. p - 1] < a[p] == P <= a[p + 1 .. up] */
+    if (p - lo < n / 8 || up - p < n / 8) {  /* too imbalanced? */
+      if (--bad == 0) {
+        heapsort(L, lo, up, raw);
+        return;
+      }
+      rnd = l_randomizePivot();  /* try a new randomization */
+    }
+    else if (done && partialinsertion(L, lo, p - 1, raw) &&
+                     partialinsertion(L, p + 1, up, raw))
+      return;  /* was (almost) sorted already */
+    if (p - lo < up - p) {  /* lower interval is smaller? */
+      auxsort(L, lo, p - 1, rnd, bad, leftmost, raw);
+      lo = p + 1;  /* tail call for [p + 1 .. up] (upper interval) */
+      leftmost = 0;
+    }
+    else {
+      auxsort(L, p + 1, up, rnd, bad, 0, raw);
+      up = p - 1;  /* tail call for [lo .. p - 1]  (lower interval) */
+    }
+  }
+}
+
+
+/* number of bad partitions allowed before switching to heapsort */
+static int badlimit (IdxT n) {
+  int bad = 1;
+  while (n >>= 1)
+    bad++;
+  return bad;
+}
+
+
+/*
+** Check the order argument of the sort functions: nil, a function, or
+** a comparator spec like '{"last", "first", desc=true}', which lists
+** the fields to compare, with 'desc' being a boolean or a table of
+** booleans (one for each field). A spec is replaced by a normalized
+** copy (see 'spec_comp'). Returns the number of fields of a spec.
+*/
+static int checkcomp (lua_State *L, int arg) {
+  int i, t = lua_type(L, arg);
+  if (t == LUA_TNONE || t == LUA_TNIL || t == LUA_TFUNCTION)
+    return 0;
+  if (t != LUA_TTABLE)
+    return luaL_argerror(L, arg, lua_pushfstring(L,
+                         "function or table expected, got %s",
+                         luaL_typename(L, arg)));
+  lua_newtable(L);
+  lua_getfield(L, arg, "desc");
+  for (i = 1; i < INT_MAX / 2; i++) {
+    lua_rawgeti(L, arg, i);
+    if (lua_isnil(L, -1))
+      break;
+    lua_rawseti(L, -3, 2 * i - 1);
+    if (lua_istable(L, -1))
+      lua_rawgeti(L, -1, i);
+    else
+      lua_pushvalue(L, -1);
+    lua_pushboolean(L, lua_toboolean(L, -1));
+    lua_rawseti(L, -4, 2 * i);
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, i > 1, arg, "empty comparator spec");
+  lua_pop(L, 2);  /* remove nil and 'desc' */
+  lua_replace(L, arg);
+  return i - 1;
+}
+
+
+/*
+** Sort 't[1..n]' by the fields of the comparator spec at index 2 (see
+** 'fieldorder') if that is worth it. Every field is read only once per
+** element, and the keys are often sorted natively.
+*/
+static int fieldsort (lua_State *L, lua_Integer n, int fields, int raw) {
+  if (fields > 0 && (IdxT)n >= NATIVELIMIT) {
+    IdxT *q = fieldorder(L, (IdxT)n, raw, fields);
+    applyperm(L, 1, raw, q, 1, (IdxT)n);
+    lua_pop(L, 1);  /* remove permutation */
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+** Get a positive integer field from the (optional) options table of
+** 'sort', or 0 if it is not there.
+*/
+static lua_Integer sortoption (lua_State *L, int arg, const char *name,
+                               const char *msg) {
+  lua_Integer v = 0;
+  if (!lua_isnoneornil(L, arg)) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_getfield(L, arg, name);
+    if (!lua_isnil(L, -1)) {
+      int valid = 0;
+      v = lua_tointegerx(L, -1, &valid);
+      luaL_argcheck(L, valid && v >= 1, arg, msg);
+    }
+    lua_pop(L, 1);
+  }
+  return v;
+}
+
+
+/*
+** {------------------------------------------------------
+** Resumable sort: a bottom-up merge sort that keeps all of its state
+** in a userdata (at index 3) and two scratch tables (at indices 4 and
+** 5, with the runs of the current pass in the table at index 4), so
+** it can yield every 'budget' comparisons and call order functions
+** with 'lua_callk'. 't' is only written to at the very end.
+** -------------------------------------------------------
+*/
+
+typedef struct SortState {
+  IdxT n;  /* number of elements */
+  IdxT w;  /* length of the runs in the current pass */
+  IdxT mid, up;  /* end of the first and of the second run */
+  IdxT i, j, k;  /* next element of the two runs and of the result */
+  int raw;  /* access 't' raw? */
+  lua_Integer budget;  /* comparisons between yields */
+  lua_Integer count;  /* comparisons since the last yield */
+} SortState;
+
+
+/* contexts for 'sortk' */
+#define SK_START	0
+#define SK_CALL		1
+#define SK_YIELD	2
+
+
+/* set up the merge of the two runs starting at 'lo' */
+static void nextmerge (lua_State *L, SortState *st, IdxT lo) {
+  if (lo >= st->n) {  /* end of the pass? */
+    lo = 0;
+    st->w *= 2;
+    lua_pushvalue(L, 4);  /* swap source and destination */
+    lua_pushvalue(L, 5);
+    lua_replace(L, 4);
+    lua_replace(L, 5);
+  }
+  st->mid = (st->n - lo > st->w) ? lo + st->w : st->n;
+  st->up = (st->n - st->mid > st->w) ? st->mid + st->w : st->n;
+  st->i = lo;
+  st->j = st->mid;
+  st->k = lo;
+}
+
+
+/* move the next element of the second run (or the first) to the result */
+static void take (lua_State *L, SortState *st, int second) {
+  lua_rawgeti(L, 4, (second ? st->j++ : st->i++) + 1);
+  lua_rawseti(L, 5, ++st->k);
+}
+
+
+LUA_KFUNCTION(sortk) {
+  SortState *st = (SortState *)lua_touserdata(L, 3);
+  IdxT k;
+  (void)status;
+  if (ctx == SK_CALL) {  /* back from the order function */
+    int res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    take(L, st, res);
+  }
+  else if (ctx == SK_YIELD)
+    lua_settop(L, 5);  /* remove the values passed to 'resume' */
+  while (st->w < st->n) {
+    if (st->i < st->mid && st->j < st->up) {
+      int res;
+#if LUA_VERSION_NUM >= 503
+      if (st->count >= st->budget && lua_isyieldable(L)) {
+        st->count = 0;
+        return lua_yieldk(L, 0, SK_YIELD, sortk);
+      }
+#endif
+      st->count++;
+      if (lua_isfunction(L, 2)) {
+        lua_pushvalue(L, 2);
+        lua_rawgeti(L, 4, st->j + 1);
+        lua_rawgeti(L, 4, st->i + 1);
+        lua_callk(L, 2, 1, SK_CALL, sortk);
+        res = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+      }
+      else {
+        lua_rawgeti(L, 4, st->j + 1);
+        lua_rawgeti(L, 4, st->i + 1);
+        res = sort_comp(L, -2, -1);
+        lua_pop(L, 2);
+      }
+      take(L, st, res);
+    }
+    else {  /* copy the rest of the other run */
+      while (st->i < st->mid)
+        take(L, st, 0);
+      while (st->j < st->up)
+        take(L, st, 1);
+      nextmerge(L, st, st->up);
+    }
+  }
+  for (k = 1; k <= st->n; k++) {
+    lua_rawgeti(L, 4, k);
+    aux_seti(L, 1, k, st->raw);
+  }
+  return 0;
+}
+
+
+static int resumablesort (lua_State *L, IdxT n, lua_Integer budget) {
+  SortState *st;
+  IdxT k;
+  int raw = israw(L, 1);
+  st = (SortState *)lua_newuserdata(L, sizeof(SortState));
+  st->n = n;
+  st->w = 1;
+  st->raw = raw;
+  st->budget = budget;
+  st->count = 0;
+  lua_createtable(L, (int)n, 0);  /* source (index 4) */
+  lua_createtable(L, (int)n, 0);  /* destination (index 5) */
+  for (k = 1; k <= n; k++) {
+    aux_geti(L, 1, k, raw);
+    lua_rawseti(L, 4, k);
+  }
+  nextmerge(L, st, 0);
+  return sortk(L, 0, SK_START);
+}
+
+/* }------------------------------------------------------ */
+
+
+/*
+** Sort an object with bulk transfers (see 'getblock') by sorting a
+** plain copy of it with 'f' and copying the result back. The order
+** argument must not have been normalized by 'checkcomp' yet, because
+** 'f' checks it again.
+*/
+static int bulksort (lua_State *L, lua_Integer n, lua_CFunction f) {
+  int i, top = lua_gettop(L);
+  lua_createtable(L, (int)n, 1);
+  copyrange(L, 1, 1, n, top + 1, 1, 0);
+  set_n(L, top + 1, n);
+  lua_pushvalue(L, NKEY);
+  lua_pushcclosure(L, f, 1);
+  lua_pushvalue(L, top + 1);
+  for (i = 2; i <= top; i++)  /* order function and options */
+    lua_pushvalue(L, i);
+  lua_call(L, top, 0);
+  copyrange(L, top + 1, 1, n, 1, 1, 0);
+  return 0;
+}
+
+
+static int sort (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  int raw, threads, fields;
+  lua_Integer opt, budget, lo = 1, up = n;
+  Typed *a;
+  if (n > 1) {  /* non-trivial interval? */
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    opt = sortoption(L, 3, "threads", "invalid number of threads");
+    threads = (opt < 1) ? 1 : (opt < INT_MAX) ? (int)opt : INT_MAX;
+    budget = sortoption(L, 3, "budget", "invalid budget");
+    if (budget == 0 && isbulk(L, 1, 1))  /* before 'checkcomp' */
+      return bulksort(L, n, sort);
+    fields = checkcomp(L, 2);
+    lua_settop(L, 2);  /* make sure there are two arguments */
+    if (budget > 0)
+      return resumablesort(L, (IdxT)n, budget);
+    if (fieldsort(L, n, fields, israw(L, 1)))
+      return 0;
+    unview(L, 1, &lo, &up);  /* sort a slice in its parent */
+    luaL_argcheck(L, up < INT_MAX, 1, "array too big");
+    raw = israw(L, 1);
+    if (lua_isnil(L, 2) && (a = totyped(L, 1)) != NULL &&
+        typedsort(L, a, lo, up, threads, 0))
+      return 0;
+    if (lua_isnil(L, 2) && (IdxT)n >= NATIVELIMIT &&
+        nativesort(L, 1, raw, (IdxT)lo, (IdxT)up, threads, 0))
+      return 0;
+    auxsort(L, (IdxT)lo, (IdxT)up, 0, badlimit((IdxT)n), 1, raw);
+  }
+  return 0;
+}
+
+
+/*
+** Rearrange 'a[lo..up]' so that 'a[k]' gets the element that would be
+** there if the range was sorted, with no greater elements before and
+** no smaller elements after it (QuickSelect, with the same pivots,
+** partitions and fallbacks as 'auxsort').
+*/
+static void auxselect (lua_State *L, IdxT lo, IdxT up, IdxT k, int raw) {
+  IdxT first = lo;
+  unsigned int rnd = 0;
+  int bad = badlimit(up - lo + 1);
+  while (up - lo + 1 >= INSLIMIT) {
+    IdxT p;  /* Pivot index */
+    IdxT n = up - lo + 1;  /* size of the range */
+    int done;
+    selectpivot(L, lo, up, rnd, raw);
+    if (lo > first) {  /* a[lo - 1] is a previous pivot */
+      int less;
+      aux_geti(L, 1, lo - 1, raw);
+      less = pivotless(L, lo, raw);  /* a[lo - 1] < P? */
+      lua_pop(L, 1);
+      if (!less) {  /* P == a[lo - 1]? */
+        p = partitionleft(L, lo, up, raw);
+        if (k <= p)
+          return;  /* a[lo .. p] are all equal to P */
+        lo = p + 1;
+        continue;
+      }
+    }
+    p = partition(L, lo, up, raw, &done);
+    if (p == k)
+      return;
+    if (p - lo < n / 8 || up - p < n / 8) {  /* too imbalanced? */
+      if (--bad == 0) {
+        heapsort(L, lo, up, raw);
+        return;
+      }
+      rnd = l_randomizePivot();  /* try a new randomization */
+    }
+    if (k < p)
+      up = p - 1;
+    else
+      lo = p + 1;
+  }
+  binsort(L, lo, lo + 1, up, raw);
+}
+
+
+/*
+** Get the number of elements ('k', at least 'min') for 'select',
+** 'partialsort', and 'topk', and move the (optional) order function
+** or comparator spec to index 2, where 'sort_comp' expects it.
+*/
+static lua_Integer checkrank (lua_State *L, lua_Integer n,
+                              lua_Integer min) {
+  lua_Integer k = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, k >= min, 2, "position out of bounds");
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  checkcomp(L, 3);
+  lua_remove(L, 2);
+  lua_settop(L, 2);
+  return k;
+}
+
+
+static int tselect (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  lua_Integer k = checkrank(L, n, 1);
+  int raw = israw(L, 1);
+  luaL_argcheck(L, k <= n, 2, "position out of bounds");
+  auxselect(L, 1, (IdxT)n, (IdxT)k, raw);
+  aux_geti(L, 1, k, raw);
+  return 1;
+}
+
+
+static int partialsort (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  lua_Integer k = checkrank(L, n, 1);
+  if (k > n)
+    k = n;
+  if (k >= 1) {
+    int raw = israw(L, 1);
+    if (k < n) {
+      auxselect(L, 1, (IdxT)n, (IdxT)k, raw);  /* a[k] is in place */
+      k--;
+    }
+    auxsort(L, 1, (IdxT)k, 0, badlimit((IdxT)k), 1, raw);
+  }
+  return 0;
+}
+
+
+/*
+** Return the 'k' smallest elements of 't' in sorted order, using a
+** heap (with the largest of the elements so far at the root) that
+** never holds more than 'k' elements. The heap (and later the result)
+** is put at index 1, where 'siftdown' and 'heapsort' expect it.
+*/
+static int topk (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  lua_Integer k = checkrank(L, n, 0);
+  int raw = israw(L, 1);
+  IdxT i;
+  if (k > n)
+    k = n;
+  lua_pushvalue(L, 1);  /* array at index 3 */
+  lua_createtable(L, (int)k, 1);
+  lua_replace(L, 1);
+  for (i = 1; i <= (IdxT)k; i++) {
+    aux_geti(L, 3, i, raw);
+    lua_rawseti(L, 1, i);
+  }
+  for (i = (IdxT)k / 2; i > 0; )  /* build heap */
+    siftdown(L, 1, --i, (IdxT)k, 1);
+  for (i = (IdxT)k + 1; k > 0 && i <= (IdxT)n; i++) {
+    aux_geti(L, 3, i, raw);
+    lua_rawgeti(L, 1, 1);
+    if (sort_comp(L, -2, -1)) {  /* less than the largest element? */
+      lua_pop(L, 1);
+      lua_rawseti(L, 1, 1);  /* replace it */
+      siftdown(L, 1, 0, (IdxT)k, 1);
+    }
+    else
+      lua_pop(L, 2);
+  }
+  if (k > 1)
+    heapsort(L, 1, (IdxT)k, 1);
+  set_n(L, 1, k);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Extensions to the official table library
+** =======================================================
+*/
+
+/*
+** Replace 't[start..end]' by 't2[start2..end2]' for two different
+** typed arrays of the same type with one 'memmove' and one 'memcpy'.
+*/
+static int tyreplace (lua_State *L, lua_Integer len, lua_Integer start,
+                      lua_Integer end, int tpos, lua_Integer start2,
+                      lua_Integer end2) {
+  Typed *a = totyped(L, 1), *b = totyped(L, tpos);
+  lua_Integer m = end2 - start2 + 1;  /* number of new elements */
+  if (a == NULL || b == NULL || a == b || a->type != b->type ||
+      start2 < 1 || end2 > b->n)
+    return 0;
+  tyreserve(L, a, 1, len + m - (end - start + 1));
+  memmove(tyelem(a, start - 1 + m), tyelem(a, end),
+          (size_t)(len - end) * a->size);
+  memcpy(tyelem(a, start - 1), tyelem(b, start2 - 1),
+         (size_t)m * a->size);
+  a->n = len + m - (end - start + 1);
+  return 1;
+}
+
+
+static int treplace (lua_State *L) {
+  lua_Integer len, tpos, start, end, start2, end2, i;
+  int raw, raw2;
+  len = aux_getn(L, 1, TAB_RW);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    start = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, start >= 1 && start <= len+1, 2,
+                  "index out of bounds");
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+      end = luaL_checkinteger(L, 3);
+      luaL_argcheck(L, end >= start-1 && end <= len, 3,
+                    "invalid end index");
+      tpos = 4;
+    } else {
+      end = start;
+      if (end > len)
+        end = len;
+      tpos = 3;
+    }
+  } else {
+    start = len+1;
+    end = len;
+    tpos = 2;
+  }
+  checktab(L, tpos, TAB_R);
+  raw = israw(L, 1);
+  raw2 = israw(L, tpos);
+  start2 = luaL_optinteger(L, tpos+1, 1);
+  end2 = luaL_opt(L, luaL_checkinteger, tpos+2, check_n(L, tpos));
+  luaL_argcheck(L, end2 >= start2-1, tpos+2, "invalid end index");
+  if (tyreplace(L, len, start, end, tpos, start2, end2))
+    return 0;
+  if (end2-start2 > end-start)  /* array needs to grow */
+    set_n(L, 1, len+end2-start2-end+start);  /* t.n = number of elements */
+  if (start <= len) /* replace values */
+    shift(L, 1, end+1, len, end2-start2-end+start, raw);
+  /* copy from list2 to list1 */
+  if (isbulk(L, tpos, 1))
+    copyrange(L, tpos, start2, end2-start2+1, 1, start, 0);
+  else {
+    for (i = start2; i <= end2; ++i) {
+      aux_geti(L, tpos, i, raw2);
+      aux_seti(L, 1, start+i-start2, raw);
+    }
+  }
+  /* array must shrink */
+  if (end2-start2 < end-start)
+    set_n(L, 1, len+end2-start2-end+start);  /* t.n = number of elements */
+  return 0;
+}
+
+
+/*
+** Append the elements of all other arguments to 't'. 't.n' is set
+** once before the elements are written (deques and typed arrays only
+** grow at their end), so 't' itself contributes its old length when
+** it is also one of the other arguments.
+*/
+static int extend (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW), total = n, oldn = n;
+  int i, top = lua_gettop(L), raw = israw(L, 1);
+  for (i = 2; i <= top; ++i) {  /* check all arguments first */
+    lua_Integer len = aux_getn(L, i, TAB_R);
+    luaL_argcheck(L, len <= LUA_MAXINTEGER - total, i, "too many elements");
+    total += len;
+  }
+  set_n(L, 1, total);  /* t.n = number of elements */
+  for (i = 2; i <= top; ++i) {
+    lua_Integer k, len = lua_rawequal(L, i, 1) ? oldn : check_n(L, i);
+    int raw2 = israw(L, i);
+    if (isbulk(L, i, 1))
+      copyrange(L, i, 1, len, 1, n+1, 0);
+    else {
+      for (k = 1; k <= len; ++k) {
+        aux_geti(L, i, k, raw2);
+        aux_seti(L, 1, n+k, raw);
+      }
+    }
+    n += len;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static void check_callable (lua_State *L, int idx) {
+  int c = 0;
+  switch (lua_type(L, idx)) {
+    case LUA_TFUNCTION:
+      c = 1;
+      break;
+    case LUA_TUSERDATA: /* fall through */
+    case LUA_TTABLE:
+      if (luaL_getmetafield(L, idx, "__call")) {
+        lua_pop(L, 1);
+        c = 1;
+      }
+      break;
+  }
+  luaL_argcheck(L, c, idx, "callable value expected");
+}
+
+
+/*
+** Output of 'writeconcat': either a C file (written directly) or a
+** Lua function (called with chunks of up to WCHUNK bytes).
+*/
+#define WCHUNK	(1u << 16)
+
+typedef struct Writer {
+  FILE *f;  /* output file (or NULL to call the writer at index 6) */
+  int method;  /* is the writer the 'write' method of 'out'? */
+  size_t len;  /* number of bytes in 'buf' */
+  lua_Integer total;  /* number of bytes written */
+  char *buf;
+} Writer;
+
+
+static void wout (lua_State *L, Writer *w, const char *s, size_t l) {
+  if (l == 0)
+    return;
+  w->total += (lua_Integer)l;
+  if (w->f != NULL) {
+    if (fwrite(s, 1, l, w->f) != l)
+      luaL_error(L, "%s", strerror(errno));
+  }
+  else {
+    lua_pushvalue(L, 6);
+    if (w->method)
+      lua_pushvalue(L, 1);  /* 'self' */
+    lua_pushlstring(L, s, l);
+    lua_call(L, 1 + w->method, 2);
+    if (w->method && !lua_toboolean(L, -2))  /* 'file:write' failed? */
+      luaL_error(L, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1)
+                                               : "write error");
+    lua_pop(L, 2);
+  }
+}
+
+
+static void wadd (lua_State *L, Writer *w, const char *s, size_t l) {
+  if (w->f != NULL)  /* C files are buffered already */
+    wout(L, w, s, l);
+  else {
+    if (w->len + l > WCHUNK) {  /* flush buffer */
+      wout(L, w, w->buf, w->len);
+      w->len = 0;
+    }
+    if (l > WCHUNK)  /* too big for the buffer */
+      wout(L, w, s, l);
+    else {
+      memcpy(w->buf + w->len, s, l);
+      w->len += l;
+    }
+  }
+}
+
+
+/*
+** Like 'concat', but writes the result to 'out' (a file handle or a
+** callable value) instead of building a string, and returns the
+** number of bytes written.
+*/
+static int writeconcat (lua_State *L) {
+  Writer w;
+  lua_Integer i, last;
+  size_t lsep, l;
+  const char *sep, *s;
+  int raw;
+  checktab(L, 2, TAB_R);
+  sep = luaL_optlstring(L, 3, "", &lsep);
+  i = luaL_optinteger(L, 4, 1);
+  last = luaL_opt(L, luaL_checkinteger, 5, check_n(L, 2));
+  lua_settop(L, 5);
+  w.f = NULL;
+  w.method = 0;
+  w.len = 0;
+  w.total = 0;
+  if (luaL_testudata(L, 1, LUA_FILEHANDLE) != NULL) {
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *p = (luaL_Stream *)lua_touserdata(L, 1);
+    if (p->closef == NULL)
+      return luaL_error(L, "attempt to use a closed file");
+    w.f = p->f;
+#endif
+    lua_getfield(L, 1, "write");  /* writer (index 6) */
+    w.method = 1;
+  }
+  else {
+    check_callable(L, 1);
+    lua_pushvalue(L, 1);  /* writer (index 6) */
+  }
+  w.buf = (char *)lua_newuserdata(L, WCHUNK);
+  unview(L, 2, &i, &last);
+  raw = israw(L, 2);
+  for (; i <= last; i++) {
+    aux_geti(L, 2, i, raw);
+    checkconcat(L, i, "writeconcat");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      char buff[NUMBUFF];
+      l = fmtnum(L, -1, buff);
+      wadd(L, &w, buff, l);
+    }
+    else {
+      s = lua_tolstring(L, -1, &l);
+      wadd(L, &w, s, l);
+    }
+    lua_pop(L, 1);
+    if (i == last)
+      break;  /* (avoids overflows) */
+    wadd(L, &w, sep, lsep);
+  }
+  wout(L, &w, w.buf, w.len);
+  lua_pushinteger(L, w.total);
+  return 1;
+}
+
+
+/* largest number of values per call that 'zip' presizes for */
+#define ZIPPRESIZE	4
+
+
+LUA_KFUNCTION(tzipk) {
+  lua_Integer i = 1, j = 1, len, oldn = -1;
+  int k, n, top;
+  (void)status;
+  switch (ctx) {
+    case 0: /* zip(func, t_1, ..., t_n) */
+    case 2: /* zip_into(dst, func, t_1, ..., t_n) */
+      if (ctx == 2) {
+        checktab(L, 1, TAB_RW);
+        oldn = get_n(L, 1);
+        if (oldn < 0)
+          oldn = 0;
+        lua_pushvalue(L, 1);
+        lua_remove(L, 1); /* move dst to the top */
+      }
+      if (lua_isnoneornil(L, 1)) {
+        lua_pushvalue(L, NKEY);
+        lua_pushcclosure(L, pack, 1);
+        lua_replace(L, 1);
+      } else
+        check_callable(L, 1);
+      n = lua_gettop(L)-1-(ctx == 2);
+      len = aux_getn(L, 2, TAB_R);
+      for (k = 3; k <= n+1; ++k) {
+        lua_Integer l = aux_getn(L, k, TAB_R);
+        if (l < len)
+          len = l;
+      }
+      lua_pushinteger(L, n); /* store number of arrays */
+      lua_insert(L, 2);
+      lua_pushinteger(L, 1); /* store current iteration index */
+      lua_pushvalue(L, -1); /* store current target index */
+      lua_pushinteger(L, len); /* store length on stack */
+      if (ctx == 2) {
+        lua_pushvalue(L, n+3);
+        lua_remove(L, n+3); /* move dst above the state */
+      }
+      lua_pushinteger(L, oldn); /* store old length of result */
+      if (ctx == 2)
+        lua_insert(L, -2);
+      else
+        lua_createtable(L, 0, 1); /* result table */
+      luaL_checkstack(L, n+2+LUA_MINSTACK, "zip");
+      while (i <= len) { /* func, n, t_1, ..., t_n, i, j, len, oldn, rt */
+        lua_pushvalue(L, 1);
+        for (k = 3; k <= n+2; ++k) {
+          lua_pushvalue(L, n+3);
+          lua_gettable(L, k);
+        }
+        lua_callk(L, n, LUA_MULTRET, 1, tzipk);
+    case 1: /* func, n, t_1, ..., t_n, i, j, len, oldn, rt, r_1, ..., r_m */
+        n = lua_tointeger(L, 2);
+        i = lua_tointeger(L, n+3);
+        j = lua_tointeger(L, n+4);
+        len = lua_tointeger(L, n+5);
+        top = lua_gettop(L);
+        luaL_checkstack(L, 1, "zip");
+        if (i == 1 && top > n+7 && lua_tointeger(L, n+6) < 0) {
+          /* presize rt assuming that every call returns as many values
+             (up to ZIPPRESIZE, as 'f' might filter or flat-map) */
+          int m = (top-n-7 < ZIPPRESIZE) ? (int)(top-n-7) : ZIPPRESIZE;
+          if (len <= INT_MAX/m) {
+            lua_createtable(L, (int)len*m, 1);
+            lua_replace(L, n+7);
+          }
+        }
+        if (top > n+7) {
+          int raw = israw(L, n+7);
+          if (!raw && j+top-n-8 > lua_tointeger(L, n+6))
+            set_n(L, n+7, j+top-n-8); /* proxies only grow at the end */
+          for (k = n+8; k <= top; ++k) {
+            lua_pushvalue(L, k);
+            aux_seti(L, n+7, j++, raw);
+          }
+        }
+        lua_settop(L, n+7); /* remove results r_1, ..., r_m */
+        lua_pushinteger(L, ++i);
+        lua_replace(L, n+3); /* update i */
+        lua_pushinteger(L, j);
+        lua_replace(L, n+4); /* update j */
+      }
+      oldn = lua_tointeger(L, n+6);
+  }
+  if (oldn >= j) { /* clear stale elements of dst */
+    int raw = israw(L, -1);
+    for (i = j; i <= oldn; ++i) {
+      lua_pushnil(L);
+      aux_seti(L, -2, i, raw);
+    }
+  }
+  set_n(L, -1, j-1);
+  return 1;
+}
+
+static int tzip (lua_State *L) {
+  return tzipk(L, 0, 0);
+}
+
+static int tzip_into (lua_State *L) {
+  return tzipk(L, 0, 2);
+}
+
+
+/*
+** Lazy pipelines: 'table.iter(t [, i [, j]])' returns a pipeline
+** object, and its methods 'map', 'filter', and 'take' return new
+** pipelines with one more stage. Nothing happens until 'reduce' or
+** 'collect' runs all stages for one element after the other in a
+** single loop, so there are no intermediate arrays, and a 'take'
+** stage stops reading the source as soon as it has let enough elements
+** through. The user value of a pipeline is the table '{t, f_1, ...}'
+** with the functions of its stages.
+*/
+#define PIPE		"table.n.iter"
+
+#define ST_MAP		0
+#define ST_FILTER	1
+#define ST_TAKE		2
+
+typedef struct Stage {
+  int kind;
+  lua_Integer k;  /* number of elements for 'take' */
+} Stage;
+
+typedef struct Pipe {
+  lua_Integer i, j;  /* range of the source */
+  int hasj;  /* is 'j' given (or 't.n' read when the pipeline runs)? */
+  int n;  /* number of stages */
+  Stage st[1];
+} Pipe;
+
+#define pipesize(n)	(sizeof(Pipe) + (size_t)(n) * sizeof(Stage))
+
+
+/* state of a running pipeline */
+typedef struct PipeRun {
+  lua_Integer idx, last;  /* next and last index of the source */
+  lua_Integer out;  /* number of collected elements */
+  int stage;  /* stage of the current element (-1: none) */
+  int hasacc;  /* does 'reduce' have a value already? */
+  int done;  /* did a 'take' stage let its last element through? */
+  int raw;
+  lua_Integer left[1];  /* remaining elements of every 'take' stage */
+} PipeRun;
+
+
+/* contexts for 'pipek' */
+#define PK_START	0
+#define PK_STAGE	1	/* a stage function returned */
+#define PK_REDUCE	2	/* the reduce function returned */
+
+
+/* create a copy of the pipeline at index 1 with another stage */
+static int addstage (lua_State *L, int kind, lua_Integer k) {
+  Pipe *p = (Pipe *)luaL_checkudata(L, 1, PIPE);
+  Pipe *q = (Pipe *)lua_newuserdata(L, pipesize(p->n + 1));
+  int s;
+  memcpy(q, p, pipesize(p->n));
+  q->st[q->n].kind = kind;
+  q->st[q->n].k = k;
+  q->n++;
+  lua_createtable(L, q->n + 1, 0);
+  lua_getuservalue(L, 1);
+  for (s = 1; s <= p->n + 1; s++) {  /* source and old stages */
+    lua_rawgeti(L, -1, s);
+    lua_rawseti(L, -3, s);
+  }
+  lua_pop(L, 1);
+  if (kind == ST_TAKE)
+    lua_pushboolean(L, 0);
+  else
+    lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, q->n + 1);
+  lua_setuservalue(L, -2);
+  luaL_setmetatable(L, PIPE);
+  return 1;
+}
+
+
+static int pipemap (lua_State *L) {
+  check_callable(L, 2);
+  return addstage(L, ST_MAP, 0);
+}
+
+
+static int pipefilter (lua_State *L) {
+  check_callable(L, 2);
+  return addstage(L, ST_FILTER, 0);
+}
+
+
+static int pipetake (lua_State *L) {
+  lua_Integer k = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, k >= 0, 2, "invalid number of elements");
+  return addstage(L, ST_TAKE, k);
+}
+
+
+/*
+** Handle the result (on top of the stack) of the function of the
+** current stage: 'map' replaces the current element, 'filter' may
+** drop it.
+*/
+static void stageresult (lua_State *L, Pipe *p, PipeRun *r) {
+  if (p->st[r->stage].kind == ST_MAP) {
+    lua_replace(L, 6);
+    r->stage++;
+  }
+  else {
+    r->stage = lua_toboolean(L, -1) ? r->stage + 1 : -1;
+    lua_pop(L, 1);
+  }
+}
+
+
+/*
+** Run the pipeline at index 1. The other stack slots are: 2 the
+** reduce function (or nil for 'collect'), 3 the accumulator (or the
+** result array), 4 the PipeRun, 5 the user value of the pipeline, 6
+** the current element, and 7 the source.
+*/
+LUA_KFUNCTION(pipek) {
+  Pipe *p = (Pipe *)lua_touserdata(L, 1);
+  PipeRun *r = (PipeRun *)lua_touserdata(L, 4);
+  (void)status;
+  if (ctx == PK_STAGE)
+    stageresult(L, p, r);
+  else if (ctx == PK_REDUCE) {
+    lua_replace(L, 3);
+    r->stage = -1;
+  }
+  for (;;) {
+    if (r->stage < 0) {  /* fetch next element */
+      if (r->done || r->idx > r->last)
+        break;
+      aux_geti(L, 7, r->idx, r->raw);
+      lua_replace(L, 6);
+      r->idx++;
+      r->stage = 0;
+    }
+    while (r->stage >= 0 && r->stage < p->n) {
+      if (p->st[r->stage].kind == ST_TAKE) {
+        if (--r->left[r->stage] == 0)
+          r->done = 1;  /* this is the last element */
+        r->stage++;
+      }
+      else {
+        lua_rawgeti(L, 5, r->stage + 2);
+        lua_pushvalue(L, 6);
+        lua_callk(L, 1, 1, PK_STAGE, pipek);
+        stageresult(L, p, r);
+      }
+    }
+    if (r->stage < 0)
+      continue;  /* element was dropped */
+    if (lua_isnil(L, 2)) {  /* collect */
+      lua_pushvalue(L, 6);
+      lua_rawseti(L, 3, ++r->out);
+    }
+    else if (!r->hasacc) {
+      lua_pushvalue(L, 6);
+      lua_replace(L, 3);
+      r->hasacc = 1;
+    }
+    else {
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 3);
+      lua_pushvalue(L, 6);
+      lua_callk(L, 2, 1, PK_REDUCE, pipek);
+      lua_replace(L, 3);
+    }
+    r->stage = -1;
+  }
+  if (lua_isnil(L, 2))
+    set_n(L, 3, r->out);
+  lua_settop(L, 3);
+  return 1;
+}
+
+
+/* set up the stack for 'pipek' (see there) */
+static int piperun (lua_State *L, int hasacc) {
+  Pipe *p = (Pipe *)lua_touserdata(L, 1);
+  PipeRun *r = (PipeRun *)lua_newuserdata(L, sizeof(PipeRun) +
+                                          (size_t)p->n * sizeof(lua_Integer));
+  int s;
+  r->idx = p->i;
+  r->out = 0;
+  r->stage = -1;
+  r->hasacc = hasacc;
+  r->done = 0;
+  for (s = 0; s < p->n; s++) {
+    r->left[s] = p->st[s].k;
+    if (p->st[s].kind == ST_TAKE && p->st[s].k == 0)
+      r->done = 1;  /* nothing gets through */
+  }
+  lua_getuservalue(L, 1);
+  lua_pushnil(L);  /* current element */
+  lua_rawgeti(L, 5, 1);  /* source */
+  r->last = p->hasj ? p->j : aux_getn(L, 7, TAB_R);
+  r->raw = israw(L, 7);
+  return pipek(L, LUA_OK, PK_START);
+}
+
+
+static int pipereduce (lua_State *L) {
+  luaL_checkudata(L, 1, PIPE);
+  check_callable(L, 2);
+  lua_settop(L, 3);
+  return piperun(L, !lua_isnil(L, 3));
+}
+
+
+static int pipecollect (lua_State *L) {
+  luaL_checkudata(L, 1, PIPE);
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  lua_createtable(L, 0, 1);
+  return piperun(L, 0);
+}
+
+
+static int iter (lua_State *L) {
+  lua_Integer i, j;
+  int hasj = !lua_isnoneornil(L, 3);
+  Pipe *p;
+  checktab(L, 1, TAB_R);
+  i = luaL_optinteger(L, 2, 1);
+  j = hasj ? luaL_checkinteger(L, 3) : check_n(L, 1);  /* validate '.n' */
+  p = (Pipe *)lua_newuserdata(L, pipesize(0));
+  p->i = i;
+  p->hasj = hasj;
+  p->j = j;
+  p->n = 0;
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  luaL_setmetatable(L, PIPE);
+  return 1;
+}
+
+
+static const luaL_Reg pipe_methods[] = {
+  {"map", pipemap},
+  {"filter", pipefilter},
+  {"take", pipetake},
+  {"reduce", pipereduce},
+  {"collect", pipecollect},
+  {NULL, NULL}
+};
+
+
+/* create the metatable for pipelines (all functions get 'NKEY') */
+static void createpipemeta (lua_State *L) {
+  luaL_newmetatable(L, PIPE);
+  lua_newtable(L);
+  lua_pushliteral(L, "n");
+  luaL_setfuncs(L, pipe_methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
+
+
+/*
+** Create an array with room for 'narr' elements (all set to 'fill', if
+** given) and 'nhash' other fields besides 'n', which is set to 'narr'.
+*/
+static int tnew (lua_State *L) {
+  lua_Integer narr = luaL_checkinteger(L, 1);
+  lua_Integer nhash = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, 0 <= narr && narr < INT_MAX, 1, "invalid size");
+  luaL_argcheck(L, 0 <= nhash && nhash < INT_MAX, 2, "invalid size");
+  lua_settop(L, 3);
+  lua_createtable(L, (int)narr, (int)nhash + 1);
+  if (!lua_isnil(L, 3)) {
+    int i;
+    for (i = 1; i <= (int)narr; i++) {
+      lua_pushvalue(L, 3);
+      lua_rawseti(L, 4, i);
+    }
+  }
+  set_n(L, 4, narr);
+  return 1;
+}
+
+
+/*
+** Create the array '{a, a+step, a+2*step, ...}' with all elements up to
+** 'b' (down to 'b' for a negative 'step'), like a numeric 'for' loop.
+** Elements are integers if 'a' and 'step' are (a float 'b' is rounded
+** towards 'a'), otherwise floats computed as 'a+k*step' (without
+** accumulating rounding errors).
+*/
+static int range (lua_State *L) {
+  lua_Integer k, count = 0;
+  luaL_checknumber(L, 1);
+  luaL_checknumber(L, 2);
+  if (lua_isinteger(L, 1) &&
+      (lua_isnoneornil(L, 3) || lua_isinteger(L, 3))) {
+    lua_Integer a = lua_tointeger(L, 1), b;
+    lua_Integer step = luaL_optinteger(L, 3, 1);
+    lua_Unsigned c;
+    int valid = 1;
+    luaL_argcheck(L, step != 0, 3, "step is zero");
+    if (lua_isinteger(L, 2))
+      b = lua_tointeger(L, 2);
+    else {  /* clip float limit to the integer range */
+      lua_Number f = lua_tonumber(L, 2);
+      f = (step > 0) ? (lua_Number)floor(f) : -(lua_Number)floor(-f);
+      if (f != f)  /* NaN? */
+        valid = 0;
+      else if (f >= -(lua_Number)LUA_MININTEGER)
+        b = LUA_MAXINTEGER;
+      else if (f < (lua_Number)LUA_MININTEGER)
+        b = LUA_MININTEGER;
+      else
+        b = (lua_Integer)f;
+    }
+    if (valid && (step > 0 ? a <= b : a >= b)) {  /* as in 'forprep' */
+      c = (step > 0) ? ((lua_Unsigned)b - (lua_Unsigned)a) / (lua_Unsigned)step
+                     : ((lua_Unsigned)a - (lua_Unsigned)b) /
+                       ((lua_Unsigned)(-(step + 1)) + 1u);
+      luaL_argcheck(L, c < INT_MAX - 1, 2, "range too large");
+      count = (lua_Integer)c + 1;
+    }
+    lua_createtable(L, (int)count, 1);
+    for (k = 0; k < count; k++) {
+      lua_pushinteger(L, (lua_Integer)((lua_Unsigned)a +
+                                       (lua_Unsigned)k * (lua_Unsigned)step));
+      lua_rawseti(L, -2, k + 1);
+    }
+  }
+  else {
+    lua_Number a = lua_tonumber(L, 1), b = lua_tonumber(L, 2);
+    lua_Number step = luaL_optnumber(L, 3, 1);
+    luaL_argcheck(L, step != 0, 3, "step is zero");
+    if (step > 0 ? a <= b : a >= b) {
+      lua_Number c = (b - a) / step;
+      luaL_argcheck(L, c < INT_MAX - 1, 2, "range too large");
+      count = (lua_Integer)c + 1;
+    }
+    lua_createtable(L, (int)count, 1);
+    for (k = 0; k < count; k++) {
+      lua_pushnumber(L, a + (lua_Number)k * step);
+      lua_rawseti(L, -2, k + 1);
+    }
+  }
+  set_n(L, -1, count);
+  return 1;
+}
+
+
+static int npairs_iterator (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  if (i >= n)
+    return 0;
+  lua_pushinteger(L, ++i);
+  aux_geti(L, 1, i, israw(L, 1));
+  return 2;
+}
+
+
+/*
+** Iterator for 'npairs' with a fixed length: the length and the raw
+** flag are upvalues, so each step is just the index check and a get.
+*/
+static int npairs_fixed_iterator (lua_State *L) {
+  lua_Integer n = lua_tointeger(L, lua_upvalueindex(1));
+  lua_Integer i = lua_tointeger(L, 2);
+  if (i >= n)
+    return 0;
+  lua_pushinteger(L, ++i);
+  aux_geti(L, 1, i, lua_toboolean(L, lua_upvalueindex(2)));
+  return 2;
+}
+
+
+static int npairs (lua_State *L) {
+  lua_Integer s, n;
+  n = aux_getn(L, 1, TAB_R); /* check early */
+  s = luaL_optinteger(L, 2, 1);
+  if (lua_toboolean(L, 3)) {  /* read '.n' only once? */
+    lua_pushinteger(L, n);
+    lua_pushboolean(L, israw(L, 1));
+    lua_pushcclosure(L, npairs_fixed_iterator, 2);
+  }
+  else
+    lua_pushvalue(L, lua_upvalueindex(2));  /* shared 'npairs_iterator' */
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, s-1);
+  return 3;
+}
+
+
+/*
+** Reverse 't[a..b]' for the table 't' at index 1.
+*/
+static void reverse (lua_State *L, lua_Integer a, lua_Integer b,
+                     int raw) {
+  for (; a < b; ++a, --b) {
+    aux_geti(L, 1, a, raw);
+    aux_geti(L, 1, b, raw);
+    aux_seti(L, 1, a, raw);
+    aux_seti(L, 1, b, raw);
+  }
+}
+
+
+static int treverse (lua_State *L) {
+  lua_Integer begin, end;
+  Typed *a;
+  checktab(L, 1, TAB_RW);
+  begin = luaL_optinteger(L, 2, 1);
+  end = luaL_opt(L, luaL_checkinteger, 3, check_n(L, 1));
+  lua_settop(L, 1);
+  unview(L, 1, &begin, &end);
+  if ((a = totyped(L, 1)) != NULL && begin >= 1 && end <= a->n)
+    tyreverse(a, begin - 1, end - 1);
+  else
+    reverse(L, begin, end, israw(L, 1));
+  return 0;
+}
+
+
+static int trotate (lua_State *L) {
+  lua_Integer n, begin, end;
+  Typed *a;
+  checktab(L, 1, TAB_RW);
+  n = -luaL_checkinteger(L, 2);
+  begin = luaL_optinteger(L, 3, 1);
+  end = luaL_opt(L, luaL_checkinteger, 4, check_n(L, 1));
+  if (end > begin) {
+    n %= end - begin + 1;
+    if (n < 0)
+      n += end - begin + 1;
+    unview(L, 1, &begin, &end);
+    if (n != 0 && (a = totyped(L, 1)) != NULL && begin >= 1 &&
+        end <= a->n) {
+      tyreverse(a, begin-1, begin+n-2);
+      tyreverse(a, begin+n-1, end-1);
+      tyreverse(a, begin-1, end-1);
+    }
+    else if (n != 0) {
+      int raw = israw(L, 1);
+      lua_settop(L, 1);
+      reverse(L, begin, begin+n-1, raw);
+      reverse(L, begin+n, end, raw);
+      reverse(L, begin, end, raw);
+    }
+  }
+  return 0;
+}
+
+
+/*
+** Pseudo-random numbers for 'shuffle' and 'sample': xoshiro256**
+** (by David Blackman and Sebastiano Vigna). Without an explicit seed
+** the functions share a generator stored in the registry, which is
+** seeded once from the time and an address.
+*/
+#define RANDKEY		"table.n.random"
+
+#if ((ULONG_MAX >> 31) >> 31) >= 3
+
+/* 'long' has at least 64 bits */
+#define Rand64		unsigned long
+
+#elif !defined(LUA_USE_C89) && defined(LLONG_MAX)
+
+/* there is a 'long long' type (which must have at least 64 bits) */
+#define Rand64		unsigned long long
+
+#endif
+
+
+#if defined(Rand64)  /* { */
+
+/* 'Rand64' may have more than 64 bits */
+#define trim64(x)	((x) & 0xffffffffffffffffu)
+
+#define Int2I(x)	((Rand64)(x))
+#define I2UInt(x)	((lua_Unsigned)trim64(x))
+
+static Rand64 rotl (Rand64 x, int n) {
+  return (x << n) | (trim64(x) >> (64 - n));
+}
+
+
+static Rand64 nextrand (Rand64 *s) {
+  Rand64 r = rotl(s[1] * 5, 7) * 9;
+  Rand64 t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return r;
+}
+
+#else  /* }{ */
+
+/*
+** No 64-bit integer type: the values are pairs of 32-bit halves (as in
+** 'lmathlib.c' of Lua 5.4).
+*/
+#if (UINT_MAX >> 30) >= 3
+typedef unsigned int lu_int32;
+#else
+typedef unsigned long lu_int32;
+#endif
+
+typedef struct Rand64 {
+  lu_int32 h;  /* higher half */
+  lu_int32 l;  /* lower half */
+} Rand64;
+
+#define trim32(x)	((x) & 0xffffffffu)
+
+static Rand64 packI (lu_int32 h, lu_int32 l) {
+  Rand64 r;
+  r.h = h;
+  r.l = l;
+  return r;
+}
+
+
+/* i << n, for 0 < n < 32 */
+static Rand64 Ishl64 (Rand64 i, int n) {
+  return packI((i.h << n) | (trim32(i.l) >> (32 - n)), i.l << n);
+}
+
+
+static void Ixor (Rand64 *i1, Rand64 i2) {
+  i1->h ^= i2.h;
+  i1->l ^= i2.l;
+}
+
+
+static Rand64 Iadd64 (Rand64 i1, Rand64 i2) {
+  Rand64 r = packI(i1.h + i2.h, i1.l + i2.l);
+  if (trim32(r.l) < trim32(i1.l))  /* carry? */
+    r.h++;
+  return r;
+}
+
+
+/* 'i' rotated left by 'n' bits, for 0 < n < 32 */
+static Rand64 rotl (Rand64 i, int n) {
+  return packI((i.h << n) | (trim32(i.l) >> (32 - n)),
+               (trim32(i.h) >> (32 - n)) | (i.l << n));
+}
+
+
+/* 'i' rotated left by 'n' bits, for 32 < n < 64 */
+static Rand64 rotl1 (Rand64 i, int n) {
+  n = 64 - n;
+  return packI((trim32(i.h) >> n) | (i.l << (32 - n)),
+               (i.h << (32 - n)) | (trim32(i.l) >> n));
+}
+
+
+static Rand64 nextrand (Rand64 *s) {
+  Rand64 x = Iadd64(Ishl64(s[1], 2), s[1]);  /* s[1] * 5 */
+  Rand64 r = rotl(x, 7);
+  Rand64 t = Ishl64(s[1], 17);
+  r = Iadd64(Ishl64(r, 3), r);  /* r * 9 */
+  Ixor(&s[2], s[0]);
+  Ixor(&s[3], s[1]);
+  Ixor(&s[1], s[2]);
+  Ixor(&s[0], s[3]);
+  Ixor(&s[2], t);
+  s[3] = rotl1(s[3], 45);
+  return r;
+}
+
+
+static Rand64 Int2I (lua_Unsigned n) {
+  return packI((lu_int32)(n >> 31 >> 1), (lu_int32)n);
+}
+
+
+static lua_Unsigned I2UInt (Rand64 x) {
+  return ((lua_Unsigned)trim32(x.h) << 31 << 1) | (lua_Unsigned)trim32(x.l);
+}
+
+#endif  /* } */
+
+
+/*
+** Seed the generator with two numbers, as 'math.randomseed' does in
+** Lua 5.4.
+*/
+static void seedrand (Rand64 *s, lua_Unsigned n1, lua_Unsigned n2) {
+  int i;
+  s[0] = Int2I(n1);
+  s[1] = Int2I(0xff);  /* avoid a zero state */
+  s[2] = Int2I(n2);
+  s[3] = Int2I(0);
+  for (i = 0; i < 16; i++)
+    nextrand(s);  /* discard the first values to spread the seed */
+}
+
+
+/*
+** Random integer in '[0, n]' without bias: random numbers are masked
+** to the bits needed for 'n' and rejected while greater than 'n'
+** (which happens less than half of the time).
+*/
+static lua_Unsigned randupto (Rand64 *s, lua_Unsigned n) {
+  lua_Unsigned r = I2UInt(nextrand(s)), lim = n;
+  if ((n & (n + 1)) != 0) {  /* 'n + 1' is not a power of 2? */
+    lim |= (lim >> 1);
+    lim |= (lim >> 2);
+    lim |= (lim >> 4);
+    lim |= (lim >> 8);
+    lim |= (lim >> 16);
+    if (sizeof(lua_Unsigned) > 4)
+      lim |= (lim >> 31 >> 1);  /* (no shift by 32 for 32-bit types) */
+    while ((r &= lim) > n)
+      r = I2UInt(nextrand(s));
+  }
+  return r & lim;
+}
+
+
+/*
+** Get the generator for the optional seed at 'arg': 'buf' seeded with
+** it, or the shared generator.
+*/
+static Rand64 *getrand (lua_State *L, int arg, Rand64 *buf) {
+  Rand64 *s;
+  if (!lua_isnoneornil(L, arg)) {
+    seedrand(buf, (lua_Unsigned)luaL_checkinteger(L, arg), 0);
+    return buf;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, RANDKEY);
+  s = (Rand64 *)lua_touserdata(L, -1);
+  if (s == NULL) {  /* first use? */
+    s = (Rand64 *)lua_newuserdata(L, 4 * sizeof(Rand64));
+    seedrand(s, (lua_Unsigned)l_randomizePivot(),
+                (lua_Unsigned)(size_t)L ^ (lua_Unsigned)(size_t)&buf);
+    lua_setfield(L, LUA_REGISTRYINDEX, RANDKEY);
+  }
+  lua_pop(L, 1);  /* the registry keeps the userdata alive */
+  return s;
+}
+
+
+static int tshuffle (lua_State *L) {
+  lua_Integer begin, end;
+  Rand64 buf[4], *s;
+  Typed *a;
+  int raw;
+  checktab(L, 1, TAB_RW);
+  begin = luaL_optinteger(L, 2, 1);
+  end = luaL_opt(L, luaL_checkinteger, 3, check_n(L, 1));
+  s = getrand(L, 4, buf);
+  lua_settop(L, 1);
+  unview(L, 1, &begin, &end);
+  raw = israw(L, 1);
+  a = totyped(L, 1);
+  if (a != NULL && (begin < 1 || end > a->n))
+    a = NULL;  /* let the metamethods handle it */
+  while (end > begin) {
+    lua_Integer j = begin +
+                    (lua_Integer)randupto(s, (lua_Unsigned)(end - begin));
+    if (a != NULL)
+      tyswap(a, end - 1, j - 1);
+    else {
+      aux_geti(L, 1, end, raw);
+      aux_geti(L, 1, j, raw);
+      aux_seti(L, 1, end, raw);
+      aux_seti(L, 1, j, raw);
+    }
+    --end;
+  }
+  return 0;
+}
+
+
+/* where the element at index 'i' went in 'sample' */
+static lua_Integer moved (lua_State *L, lua_Integer i) {
+  lua_Integer v;
+  lua_rawgeti(L, 3, i);
+  v = lua_isnil(L, -1) ? i : lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return v;
+}
+
+
+/*
+** Return a table with 'k' distinct elements of 't' in random order:
+** the first 'k' steps of a Fisher-Yates shuffle of the indices 1..n.
+** The indices that these steps move are kept in a scratch table, so
+** 't' stays untouched and the time is O(k) regardless of 'n'.
+*/
+static int sample (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  lua_Integer k = luaL_checkinteger(L, 2), i;
+  Rand64 buf[4], *s;
+  int raw = israw(L, 1);
+  luaL_argcheck(L, 0 <= k && k <= n, 2, "sample size out of range");
+  luaL_argcheck(L, k < INT_MAX, 2, "sample too big");
+  s = getrand(L, 3, buf);
+  lua_settop(L, 1);
+  lua_createtable(L, (int)k, 1);  /* 2: result */
+  lua_newtable(L);  /* 3: moved indices */
+  for (i = 1; i <= k; i++) {
+    lua_Integer r = i + (lua_Integer)randupto(s, (lua_Unsigned)(n - i));
+    lua_Integer v = moved(L, r);
+    if (r != i) {  /* 'i' is never chosen again, so only 'r' is updated */
+      lua_pushinteger(L, moved(L, i));
+      lua_rawseti(L, 3, r);
+    }
+    aux_geti(L, 1, v, raw);
+    lua_rawseti(L, 2, i);
+  }
+  lua_pop(L, 1);
+  set_n(L, 2, k);
+  return 1;
+}
+
+
+/*
+** Return the indices of the elements of 't' in sorted order (see
+** 'keyorder'), without modifying 't'. The order is stable.
+*/
+static int sortperm (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  int raw, fields;
+  IdxT k, *q;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  fields = checkcomp(L, 2);
+  lua_settop(L, 2);
+  raw = israw(L, 1);
+  if (fields > 0)
+    q = fieldorder(L, (IdxT)n, raw, fields);
+  else {
+    q = newperm(L, (IdxT)n);
+    keyorder(L, (IdxT)n, raw, KEYSELF, 0, lua_isfunction(L, 2), q);
+  }
+  lua_createtable(L, (int)n, 1);
+  for (k = 0; k < (IdxT)n; k++) {
+    lua_pushinteger(L, (lua_Integer)q[k]);
+    lua_rawseti(L, -2, k + 1);
+  }
+  set_n(L, -1, n);
+  return 1;
+}
+
+
+/*
+** Rearrange the arrays 't1, t2, ...' so that 'ti[k]' gets the old
+** value of 'ti[p[k]]'. All arguments are checked before any array is
+** modified.
+*/
+static int permute (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  int i, top = lua_gettop(L), raw = israw(L, 1);
+  IdxT k, *p, *w;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  for (i = 2; i <= top; i++)
+    luaL_argcheck(L, aux_getn(L, i, TAB_RW) == n, i,
+                  "wrong number of elements");
+  p = (IdxT *)lua_newuserdata(L, 2 * (size_t)n * sizeof(IdxT));
+  w = p + n;
+  memset(w, 0, (size_t)n * sizeof(IdxT));  /* marks used indices */
+  for (k = 0; k < (IdxT)n; k++) {
+    int valid;
+    lua_Integer v;
+    aux_geti(L, 1, k + 1, raw);
+    v = lua_tointegerx(L, -1, &valid);
+    luaL_argcheck(L, valid && v >= 1 && v <= n && !w[v - 1], 1,
+                  "invalid permutation");
+    w[v - 1] = 1;
+    p[k] = (IdxT)v;
+    lua_pop(L, 1);
+  }
+  for (i = 2; i <= top; i++) {
+    memcpy(w, p, (size_t)n * sizeof(IdxT));  /* 'applyperm' destroys it */
+    applyperm(L, i, israw(L, i), w, 1, (IdxT)n);
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Numeric reductions
+** =======================================================
+*/
+
+
+/*
+** Integers are added with wrap-around (like the '+' operator does),
+** but the wrap-arounds are counted, so that a sum that also has floats
+** gets the exact sum of its integers. Floats are added by pairwise
+** summation: blocks of SUMBLOCK floats are summed
+** with several accumulators (a loop that compilers can vectorize),
+** and the block sums are combined like the digits of a binary
+** counter, so the rounding error only grows with log(n).
+*/
+#define SUMBLOCK	128
+
+typedef struct Sum {
+  lua_Unsigned isum;  /* sum of the integers (with wrap-around) */
+  lua_Integer carry;  /* number of wrap-arounds of 'isum' */
+  int hasflt;  /* were any floats added? */
+  int nb;  /* number of floats in 'buf' */
+  int np;  /* number of pending partial sums */
+  lua_Integer nblocks;  /* number of complete blocks */
+  lua_Number part[64];  /* pending partial sums */
+  lua_Number buf[SUMBLOCK];
+} Sum;
+
+
+static void suminit (Sum *s) {
+  s->isum = 0;
+  s->carry = 0;
+  s->hasflt = s->nb = s->np = 0;
+  s->nblocks = 0;
+}
+
+
+static lua_Number blocksum (const lua_Number *a, size_t n) {
+  lua_Number s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  size_t i, k, e = n - n % 8;
+  for (i = 0; i < e; i += 8)
+    for (k = 0; k < 8; k++)
+      s[k] += a[i + k];
+  for (; i < n; i++)
+    s[0] += a[i];
+  return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
+
+static lua_Number dotblock (const lua_Number *a, const lua_Number *b,
+                            size_t n) {
+  lua_Number s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  size_t i, k, e = n - n % 8;
+  for (i = 0; i < e; i += 8)
+    for (k = 0; k < 8; k++)
+      s[k] += a[i + k] * b[i + k];
+  for (; i < n; i++)
+    s[0] += a[i] * b[i];
+  return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
+
+/* add the sum of a complete block */
+static void addpart (Sum *s, lua_Number x) {
+  lua_Integer b;
+  s->part[s->np++] = x;
+  for (b = ++s->nblocks; (b & 1) == 0; b >>= 1) {  /* carry */
+    s->np--;
+    s->part[s->np - 1] += s->part[s->np];
+  }
+}
+
+
+static void addflts (Sum *s, const lua_Number *a, size_t n) {
+  s->hasflt = 1;
+  while (n > 0) {
+    if (s->nb == 0 && n >= SUMBLOCK) {  /* sum the block in place */
+      addpart(s, blocksum(a, SUMBLOCK));
+      a += SUMBLOCK;
+      n -= SUMBLOCK;
+    }
+    else {
+      size_t m = SUMBLOCK - (size_t)s->nb;
+      if (m > n)
+        m = n;
+      memcpy(s->buf + s->nb, a, m * sizeof(lua_Number));
+      s->nb += (int)m;
+      a += m;
+      n -= m;
+      if (s->nb == SUMBLOCK) {
+        addpart(s, blocksum(s->buf, SUMBLOCK));
+        s->nb = 0;
+      }
+    }
+  }
+}
+
+
+static void addflt (Sum *s, lua_Number x) {
+  if (s->nb < SUMBLOCK - 1) {
+    s->hasflt = 1;
+    s->buf[s->nb++] = x;
+  }
+  else
+    addflts(s, &x, 1);
+}
+
+
+static void adddots (Sum *s, const lua_Number *a, const lua_Number *b,
+                     size_t n) {
+  size_t k;
+  s->hasflt = 1;
+  for (; n >= SUMBLOCK; a += SUMBLOCK, b += SUMBLOCK, n -= SUMBLOCK)
+    addpart(s, dotblock(a, b, SUMBLOCK));
+  for (k = 0; k < n; k++)  /* 's->buf' is still empty */
+    s->buf[k] = a[k] * b[k];
+  s->nb = (int)n;
+}
+
+
+static void addint (Sum *s, lua_Integer x) {
+  lua_Integer old = (lua_Integer)s->isum;
+  s->isum += (lua_Unsigned)x;
+  if (x >= 0 && (lua_Integer)s->isum < old)
+    s->carry++;
+  else if (x < 0 && (lua_Integer)s->isum > old)
+    s->carry--;
+}
+
+
+static lua_Number sumtotal (Sum *s) {
+  lua_Number t = blocksum(s->buf, (size_t)s->nb);
+  int k;
+  for (k = s->np - 1; k >= 0; k--)
+    t += s->part[k];
+  t += (lua_Number)s->carry * -2 * (lua_Number)LUA_MININTEGER;
+  return t + (lua_Number)(lua_Integer)s->isum;
+}
+
+
+/* push the sum: an integer if only integers were added */
+static void pushsum (lua_State *L, Sum *s) {
+  if (s->hasflt)
+    lua_pushnumber(L, sumtotal(s));
+  else
+    lua_pushinteger(L, (lua_Integer)s->isum);
+}
+
+
+/* a number of either subtype */
+typedef struct Num {
+  int isint;
+  lua_Integer i;
+  lua_Number f;
+} Num;
+
+#define numisnan(x)	(!(x)->isint && (x)->f != (x)->f)
+
+
+/*
+** Is 'a < b'? Integers and floats are compared exactly (as the '<'
+** operator does), e.g. 2^53+1 is greater than the float 2^53.
+*/
+static int numlt (const Num *a, const Num *b) {
+  if (a->isint == b->isint)
+    return a->isint ? a->i < b->i : a->f < b->f;
+  else if (a->isint) {  /* i < f <=> i < ceil(f) */
+    lua_Number f = b->f;
+    if (f != f || f <= (lua_Number)LUA_MININTEGER)
+      return 0;
+    else if (f >= -(lua_Number)LUA_MININTEGER)
+      return 1;
+    return a->i < (lua_Integer)ceil(f);
+  }
+  else {  /* f < i <=> floor(f) < i */
+    lua_Number f = a->f;
+    if (f != f || f >= -(lua_Number)LUA_MININTEGER)
+      return 0;
+    else if (f < (lua_Number)LUA_MININTEGER)
+      return 1;
+    return (lua_Integer)floor(f) < b->i;
+  }
+}
+
+
+static void pushnum (lua_State *L, const Num *x) {
+  if (x->isint)
+    lua_pushinteger(L, x->i);
+  else
+    lua_pushnumber(L, x->f);
+}
+
+
+#define RD_SUM		1	/* sum the values */
+#define RD_EXT		2	/* find the extrema */
+#define RD_FLT		4	/* sum integers as floats (no wrap-around) */
+
+typedef struct Reduce {
+  int what;
+  Sum s;
+  Num min, max;  /* NaN if there is one */
+  lua_Integer imax;  /* index of the first maximum (or NaN) */
+  lua_Integer count;  /* number of (non-nil) values */
+  lua_Integer off;  /* offset of the indices (see 'unview') */
+} Reduce;
+
+
+/* update the extrema with 't[k]' */
+static void addext (Reduce *r, const Num *x, lua_Integer k) {
+  if (r->count == 0 || (numisnan(x) && !numisnan(&r->max))) {
+    r->min = r->max = *x;
+    r->imax = k;
+  }
+  else if (!numisnan(&r->max)) {
+    if (numlt(x, &r->min))
+      r->min = *x;
+    if (numlt(&r->max, x)) {
+      r->max = *x;
+      r->imax = k;
+    }
+  }
+}
+
+
+/* add the value at stack index 'idx' ('t[k]') */
+static void addnum (lua_State *L, Reduce *r, int idx, lua_Integer k,
+                    int skip, const char *fname) {
+  Num x;
+  x.i = 0;
+  x.f = 0;
+  if ((x.isint = isintsub(L, idx)) != 0)
+    x.i = lua_tointeger(L, idx);
+  else if (lua_type(L, idx) == LUA_TNUMBER)
+    x.f = lua_tonumber(L, idx);
+  else {
+    if (!skip || !lua_isnil(L, idx))
+      luaL_error(L, "invalid value (%s) at index %d in table for '%s'",
+                    luaL_typename(L, idx), (int)k, fname);
+    return;
+  }
+  if (r->what & RD_SUM) {
+    if (!x.isint)
+      addflt(&r->s, x.f);
+    else if (r->what & RD_FLT)
+      addflt(&r->s, (lua_Number)x.i);
+    else
+      addint(&r->s, x.i);
+  }
+  if (r->what & RD_EXT)
+    addext(r, &x, k);
+  r->count++;
+}
+
+
+/* reduce 'p[0..n-1]' (n > 0) of integer type T */
+#define tyreduceint(T,r,p,n) { \
+    const T *p_ = (const T *)(p); \
+    size_t k_, i_ = 0; \
+    if (((r)->what & (RD_SUM | RD_FLT)) == RD_SUM) { \
+      lua_Unsigned s_ = 0; \
+      for (k_ = 0; k_ < (n); k_++) \
+        s_ += (lua_Unsigned)p_[k_]; \
+      (r)->s.isum += s_; \
+    } \
+    else if ((r)->what & RD_SUM) {  /* convert a block at a time */ \
+      lua_Number b_[SUMBLOCK]; \
+      size_t m_ = 0; \
+      for (k_ = 0; k_ < (n); k_++) { \
+        b_[m_++] = (lua_Number)p_[k_]; \
+        if (m_ == SUMBLOCK || k_ + 1 == (n)) { \
+          addflts(&(r)->s, b_, m_); \
+          m_ = 0; \
+        } \
+      } \
+    } \
+    if ((r)->what & RD_EXT) { \
+      T mn_ = p_[0], mx_ = p_[0]; \
+      for (k_ = 1; k_ < (n); k_++) { \
+        if (p_[k_] < mn_) mn_ = p_[k_]; \
+        if (p_[k_] > mx_) { mx_ = p_[k_]; i_ = k_; } \
+      } \
+      (r)->min.isint = (r)->max.isint = 1; \
+      (r)->min.i = (lua_Integer)mn_; \
+      (r)->max.i = (lua_Integer)mx_; \
+      (r)->imax = (lua_Integer)i_; \
+    } }
+
+
+/* reduce the elements 'lo..up' (0-based, lo <= up) of a typed array */
+static void tyreduce (Reduce *r, Typed *a, lua_Integer lo,
+                      lua_Integer up) {
+  size_t n = (size_t)(up - lo + 1);
+  r->imax = 0;
+  if (a->type == TY_F64) {
+    const lua_Number *p = (const lua_Number *)tyelem(a, lo);
+    if (r->what & RD_SUM)
+      addflts(&r->s, p, n);
+    if (r->what & RD_EXT) {
+      lua_Number mn = p[0], mx = p[0];
+      size_t k;
+      for (k = 1; k < n && mx == mx; k++) {
+        if (p[k] != p[k]) {  /* NaN */
+          mn = mx = p[k];
+          r->imax = (lua_Integer)k;
+        }
+        else if (p[k] < mn)
+          mn = p[k];
+        else if (p[k] > mx) {
+          mx = p[k];
+          r->imax = (lua_Integer)k;
+        }
+      }
+      r->min.isint = r->max.isint = 0;
+      r->min.f = mn;
+      r->max.f = mx;
+    }
+  }
+  else if (a->type == TY_I64)
+    tyreduceint(lua_Integer, r, tyelem(a, lo), n)
+  else
+    tyreduceint(unsigned char, r, tyelem(a, lo), n)
+  r->imax += lo + 1 - r->off;
+  r->count = (lua_Integer)n;
+}
+
+
+/*
+** Reduce 't[i..j]' for the arguments '(t [, i [, j [, skipnil]]])':
+** typed arrays in C, everything else RANGEBLOCK values at a time (see
+** 'getblock'). Nils are skipped if 'skipnil' is true and raise an
+** error otherwise (like all other values that are not numbers).
+*/
+static void numreduce (lua_State *L, Reduce *r, const char *fname) {
+  lua_Integer i, j;
+  int skip;
+  Typed *a;
+  checktab(L, 1, TAB_R);
+  i = luaL_optinteger(L, 2, 1);
+  j = luaL_opt(L, luaL_checkinteger, 3, check_n(L, 1));
+  skip = lua_toboolean(L, 4);
+  lua_settop(L, 1);
+  suminit(&r->s);
+  r->count = 0;
+  r->off = i;
+  unview(L, 1, &i, &j);
+  r->off = i - r->off;
+  if ((a = totyped(L, 1)) != NULL && a->type != TY_BOOL && 1 <= i &&
+      i <= j && j <= a->n)
+    tyreduce(r, a, i - 1, j - 1);
+  else {
+    lua_Integer k = i;
+    while (k <= j) {
+      int m = (j - k < RANGEBLOCK) ? (int)(j - k + 1) : RANGEBLOCK, q;
+      getblock(L, 1, k, m);
+      for (q = 0; q < m; q++)
+        addnum(L, r, q - m, k + q - r->off, skip, fname);
+      lua_pop(L, m);
+      if (j - k < RANGEBLOCK)
+        break;
+      k += RANGEBLOCK;
+    }
+  }
+}
+
+
+static int sum (lua_State *L) {
+  Reduce r;
+  r.what = RD_SUM;
+  numreduce(L, &r, "sum");
+  pushsum(L, &r.s);
+  return 1;
+}
+
+
+static int mean (lua_State *L) {
+  Reduce r;
+  r.what = RD_SUM | RD_FLT;
+  numreduce(L, &r, "mean");
+  if (r.count == 0)
+    lua_pushnil(L);
+  else
+    lua_pushnumber(L, sumtotal(&r.s) / (lua_Number)r.count);
+  return 1;
+}
+
+
+static int minmax (lua_State *L) {
+  Reduce r;
+  r.what = RD_EXT;
+  numreduce(L, &r, "minmax");
+  if (r.count == 0)
+    return 0;
+  pushnum(L, &r.min);
+  pushnum(L, &r.max);
+  return 2;
+}
+
+
+static int argmax (lua_State *L) {
+  Reduce r;
+  r.what = RD_EXT;
+  numreduce(L, &r, "argmax");
+  if (r.count == 0)
+    return 0;
+  lua_pushinteger(L, r.imax);
+  pushnum(L, &r.max);
+  return 2;
+}
+
+
+/* dot product of 'p[0..n-1]' and 'q[0..n-1]' of integer type T */
+#define tydotint(T,s,p,q,n) { \
+    const T *p_ = (const T *)(p), *q_ = (const T *)(q); \
+    size_t k_; \
+    for (k_ = 0; k_ < (n); k_++) \
+      (s)->isum += (lua_Unsigned)p_[k_] * (lua_Unsigned)q_[k_]; }
+
+
+/*
+** 'dot(t1, t2 [, i [, j [, skipnil]]])': the sum of 't1[k] * t2[k]'
+** for 'k' in 'i..j'. Without 'j' both arrays must have the same
+** length. With 'skipnil' pairs with a nil are left out.
+*/
+static int dot (lua_State *L) {
+  lua_Integer i, j, i1, j1, i2, j2;
+  int skip;
+  Typed *a, *b;
+  Sum s;
+  checktab(L, 1, TAB_R);
+  checktab(L, 2, TAB_R);
+  i = luaL_optinteger(L, 3, 1);
+  if (lua_isnoneornil(L, 4)) {
+    j = check_n(L, 1);
+    luaL_argcheck(L, check_n(L, 2) == j, 2, "wrong number of elements");
+  }
+  else
+    j = luaL_checkinteger(L, 4);
+  skip = lua_toboolean(L, 5);
+  lua_settop(L, 2);
+  suminit(&s);
+  i1 = i2 = i;
+  j1 = j2 = j;
+  unview(L, 1, &i1, &j1);
+  unview(L, 2, &i2, &j2);
+  if ((a = totyped(L, 1)) != NULL && (b = totyped(L, 2)) != NULL &&
+      a->type == b->type && a->type != TY_BOOL && i <= j && 1 <= i1 &&
+      j1 <= a->n && 1 <= i2 && j2 <= b->n) {
+    size_t n = (size_t)(j - i + 1);
+    if (a->type == TY_F64)
+      adddots(&s, (const lua_Number *)tyelem(a, i1 - 1),
+              (const lua_Number *)tyelem(b, i2 - 1), n);
+    else if (a->type == TY_I64)
+      tydotint(lua_Integer, &s, tyelem(a, i1 - 1), tyelem(b, i2 - 1), n)
+    else
+      tydotint(unsigned char, &s, tyelem(a, i1 - 1), tyelem(b, i2 - 1), n)
+  }
+  else {
+    lua_Integer k = i;
+    while (k <= j) {
+      int m = (j - k < RANGEBLOCK) ? (int)(j - k + 1) : RANGEBLOCK, q;
+      getblock(L, 1, i1 + (k - i), m);
+      getblock(L, 2, i2 + (k - i), m);
+      for (q = 0; q < m; q++) {
+        int x = q - 2 * m, y = q - m;  /* stack indices of the pair */
+        if (skip && (lua_isnil(L, x) || lua_isnil(L, y)))
+          continue;
+        if (lua_type(L, x) != LUA_TNUMBER || lua_type(L, y) != LUA_TNUMBER)
+          luaL_error(L, "invalid value (%s) at index %d in table for '%s'",
+                        luaL_typename(L, lua_type(L, x) != LUA_TNUMBER ?
+                                         x : y), (int)(k + q), "dot");
+        if (isintsub(L, x) && isintsub(L, y))
+          addint(&s, (lua_Integer)((lua_Unsigned)lua_tointeger(L, x) *
+                                   (lua_Unsigned)lua_tointeger(L, y)));
+        else {
+          addflt(&s, lua_tonumber(L, x) * lua_tonumber(L, y));
+        }
+      }
+      lua_pop(L, 2 * m);
+      if (j - k < RANGEBLOCK)
+        break;
+      k += RANGEBLOCK;
+    }
+  }
+  pushsum(L, &s);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Stable sort
+** (a simplified Timsort: natural runs are extended to a minimal
+**  length by binary insertion sort and merged using a stack of
+**  pending runs, see 'listsort.txt' in the CPython sources)
+** =======================================================
+*/
+
+
+/* maximal number of pending runs (plenty for 2^32 elements) */
+#define MAXRUNS		64
+
+/* arrays smaller than this are sorted by binary insertion sort only */
+#define MINMERGE	64u
+
+/* consecutive "wins" of one run before a merge starts galloping */
+#define MINGALLOP	7
+
+
+typedef struct Run {
+  IdxT base, len;
+} Run;
+
+
+/*
+** Minimal run length: between MINMERGE/2 and MINMERGE, chosen such
+** that n/minrun is a power of 2 or slightly less.
+*/
+static IdxT minrun (IdxT n) {
+  IdxT r = 0;
+  while (n >= MINMERGE) {
+    r |= n & 1;
+    n >>= 1;
+  }
+  return n + r;
+}
+
+
+/*
+** Return the first index 'i' in [lo, up) such that 'not (a[i] < x)'
+** (or 'up'), where 'x' is the value at the top of the stack.
+*/
+static IdxT lowerbound (lua_State *L, IdxT lo, IdxT up, int raw) {
+  while (lo < up) {
+    IdxT m = lo + (up - lo) / 2;
+    aux_geti(L, 1, m, raw);
+    if (sort_comp(L, -1, -2))  /* a[m] < x? */
+      lo = m + 1;
+    else
+      up = m;
+    lua_pop(L, 1);
   }
+  return lo;
 }
 
 
 /*
-** Does the partition: Pivot P is at the top of the stack.
-** precondition: a[lo] <= P == a[up-1] <= a[up],
-** so it only needs to do the partition from lo + 1 to up - 2.
-** Pos-condition: a[lo .. i - 1] <= a[i] == P <= a[i + 1 .. up]
-** returns 'i'.
+** Like 'upperbound', but probes 'a[lo]', 'a[lo+1]', 'a[lo+3]',
+** 'a[lo+7]', ... first, so it is faster if the result is near 'lo'.
 */
-static IdxT partition (lua_State *L, IdxT lo, IdxT up) {
-  IdxT i = lo;  /* will be incremented before first use */
-  IdxT j = up - 1;  /* will be decremented before first use */
-  /* loop invariant: a[lo .. i] <= P <= a[j .. up] */
-  for (;;) {
-    /* next loop: repeat ++i while a[i] < P */
-    while (lua_geti(L, 1, ++i), sort_comp(L, -1, -2)) {
-      if (i == up - 1)  /* a[i] < P  but a[up - 1] == P  ?? */
-        luaL_error(L, "invalid order function for sorting");
-      lua_pop(L, 1);  /* remove a[i] */
-    }
-    /* after the loop, a[i] >= P and a[lo .. i - 1] < P */
-    /* next loop: repeat --j while P < a[j] */
-    while (lua_geti(L, 1, --j), sort_comp(L, -3, -1)) {
-      if (j < i)  /* j < i  but  a[j] > P ?? */
-        luaL_error(L, "invalid order function for sorting");
-      lua_pop(L, 1);  /* remove a[j] */
-    }
-    /* after the loop, a[j] <= P and a[j + 1 .. up] >= P */
-    if (j < i) {  /* no elements out of place? */
-      /* a[lo .. i - 1] <= P <= a[j + 1 .. i .. up] */
-      lua_pop(L, 1);  /* pop a[j] */
-      /* swap pivot (a[up - 1]) with a[i] to satisfy pos-condition */
-      set2(L, up - 1, i);
-      return i;
+static IdxT gallopupper (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT s = lo, ofs = 1;
+  while (s + ofs - 1 < up) {
+    IdxT p = s + ofs - 1;
+    int less;
+    aux_geti(L, 1, p, raw);
+    less = sort_comp(L, -2, -1);  /* x < a[p]? */
+    lua_pop(L, 1);
+    if (less) {
+      up = p;
+      break;
     }
-    /* otherwise, swap a[i] - a[j] to restore invariant and repeat */
-    set2(L, i, j);
+    lo = p + 1;
+    ofs *= 2;
   }
+  return upperbound(L, lo, up, raw);
 }
 
 
 /*
-** Choose an element in the middle (2nd-3th quarters) of [lo,up]
-** "randomized" by 'rnd'
+** Like 'lowerbound', but galloping from 'lo' (see 'gallopupper').
 */
-static IdxT choosePivot (IdxT lo, IdxT up, unsigned int rnd) {
-  IdxT r4 = (up - lo) / 4;  /* range/4 */
-  IdxT p = rnd % (r4 * 2) + (lo + r4);
-  lua_assert(lo + r4 <= p && p <= up - r4);
-  return p;
+static IdxT galloplower (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT s = lo, ofs = 1;
+  while (s + ofs - 1 < up) {
+    IdxT p = s + ofs - 1;
+    int less;
+    aux_geti(L, 1, p, raw);
+    less = sort_comp(L, -1, -2);  /* a[p] < x? */
+    lua_pop(L, 1);
+    if (!less) {
+      up = p;
+      break;
+    }
+    lo = p + 1;
+    ofs *= 2;
+  }
+  return lowerbound(L, lo, up, raw);
 }
 
 
 /*
-** QuickSort algorithm (recursive function)
+** Return the last index of the run starting at 'lo'. A strictly
+** descending run is reversed in place (strictly, so that no equal
+** elements are swapped).
 */
-static void auxsort (lua_State *L, IdxT lo, IdxT up,
-                                   unsigned int rnd) {
-  while (lo < up) {  /* loop for tail recursion */
-    IdxT p;  /* Pivot index */
-    IdxT n;  /* to be used later */
-    /* sort elements 'lo', 'p', and 'up' */
-    lua_geti(L, 1, lo);
-    lua_geti(L, 1, up);
-    if (sort_comp(L, -1, -2))  /* a[up] < a[lo]? */
-      set2(L, lo, up);  /* swap a[lo] - a[up] */
-    else
-      lua_pop(L, 2);  /* remove both values */
-    if (up - lo == 1)  /* only 2 elements? */
-      return;  /* already sorted */
-    if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
-      p = (lo + up)/2;  /* middle element is a good pivot */
-    else  /* for larger intervals, it is worth a random pivot */
-      p = choosePivot(lo, up, rnd);
-    lua_geti(L, 1, p);
-    lua_geti(L, 1, lo);
-    if (sort_comp(L, -2, -1))  /* a[p] < a[lo]? */
-      set2(L, p, lo);  /* swap a[p] - a[lo] */
+static IdxT countrun (lua_State *L, IdxT lo, IdxT up, int raw) {
+  IdxT i = lo + 1;
+  int desc;
+  if (lo == up)
+    return lo;
+  aux_geti(L, 1, lo, raw);
+  aux_geti(L, 1, i, raw);
+  desc = sort_comp(L, -1, -2);  /* a[lo + 1] < a[lo]? */
+  lua_remove(L, -2);
+  while (i < up) {
+    aux_geti(L, 1, i + 1, raw);
+    if (sort_comp(L, -1, -2) != desc)  /* end of run? */
+      break;
+    lua_remove(L, -2);
+    i++;
+  }
+  lua_settop(L, 3);
+  if (desc)
+    reverse(L, lo, i, raw);
+  return i;
+}
+
+
+/*
+** Merge the adjacent sorted runs 'runs[r]' and 'runs[r + 1]'. The
+** elements of the first run that are already in place (not greater
+** than the first element of the second run) and the elements of the
+** second run that are already in place (not less than the last
+** element of the first run) are skipped. The rest is merged into the
+** scratch table (at index 3) and copied back, so the array is not
+** modified while the order function is running. When one run "wins"
+** MINGALLOP times in a row, the merge gallops to find out how many of
+** its following elements can be copied without further comparisons.
+*/
+static void mergeat (lua_State *L, Run *runs, int r, int raw) {
+  IdxT a = runs[r].base, b = runs[r + 1].base;
+  IdxT ea = b, eb = b + runs[r + 1].len;  /* ends of both runs */
+  IdxT i, j, k;
+  int wa = 0, wb = 0;  /* consecutive wins of both runs */
+  runs[r].len += runs[r + 1].len;
+  aux_geti(L, 1, b, raw);
+  a = gallopupper(L, a, ea, raw);  /* skip elements not greater */
+  lua_pop(L, 1);
+  if (a == ea)
+    return;  /* already in order */
+  aux_geti(L, 1, ea - 1, raw);
+  eb = lowerbound(L, b, eb, raw);  /* skip elements not less */
+  lua_pop(L, 1);
+  i = a; j = b; k = 0;
+  aux_geti(L, 1, i, raw);
+  aux_geti(L, 1, j, raw);
+  for (;;) {  /* a[i] and b[j] are on the stack */
+    if (sort_comp(L, -1, -2)) {  /* b[j] < a[i]? */
+      lua_rawseti(L, 3, ++k);
+      if (++j == eb)
+        break;
+      if (++wb >= MINGALLOP) {  /* copy all b[j..] < a[i] */
+        IdxT p = galloplower(L, j, eb, raw);
+        for (; j < p; j++) {
+          aux_geti(L, 1, j, raw);
+          lua_rawseti(L, 3, ++k);
+        }
+        if (j == eb)
+          break;
+        wb = 0;
+      }
+      wa = 0;
+      aux_geti(L, 1, j, raw);
+    }
     else {
-      lua_pop(L, 1);  /* remove a[lo] */
-      lua_geti(L, 1, up);
-      if (sort_comp(L, -1, -2))  /* a[up] < a[p]? */
-        set2(L, p, up);  /* swap a[up] - a[p] */
-      else
-        lua_pop(L, 2);
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, 3, ++k);
+      lua_remove(L, -2);
+      if (++i == ea)
+        break;
+      if (++wa >= MINGALLOP) {  /* copy all a[i..] <= b[j] */
+        IdxT p = gallopupper(L, i, ea, raw);
+        for (; i < p; i++) {
+          aux_geti(L, 1, i, raw);
+          lua_rawseti(L, 3, ++k);
+        }
+        if (i == ea)
+          break;
+        wa = 0;
+      }
+      wb = 0;
+      aux_geti(L, 1, i, raw);
+      lua_insert(L, -2);
     }
-    if (up - lo == 2)  /* only 3 elements? */
-      return;  /* already sorted */
-    lua_geti(L, 1, p);  /* get middle element (Pivot) */
-    lua_pushvalue(L, -1);  /* push Pivot */
-    lua_geti(L, 1, up - 1);  /* push a[up - 1] */
-    set2(L, p, up - 1);  /* swap Pivot (a[p]) with a[up - 1] */
-    p = partition(L, lo, up);
-    /* a[lo .. p - 1] <= a[p] == P <= a[p + 1 .. up] */
-    if (p - lo < up - p) {  /* lower interval is smaller? */
-      auxsort(L, lo, p - 1, rnd);  /* call recursively for lower interval */
-      n = p - lo;  /* size of smaller interval */
-      lo = p + 1;  /* tail call for [p + 1 .. up] (upper interval) */
+  }
+  lua_settop(L, 3);
+  for (; i < ea; i++) {  /* rest of first run goes to the end */
+    aux_geti(L, 1, i, raw);
+    lua_rawseti(L, 3, ++k);
+  }
+  /* (the rest of the second run is in place already) */
+  for (i = 1; i <= k; i++) {
+    lua_rawgeti(L, 3, i);
+    aux_seti(L, 1, a + i - 1, raw);
+  }
+}
+
+
+/*
+** Merge pending runs until the run lengths (from the top of the
+** stack) grow at least like the Fibonacci numbers.
+*/
+static void mergecollapse (lua_State *L, Run *runs, int *nruns,
+                           int raw) {
+  while (*nruns > 1) {
+    int r = *nruns - 2;
+    if ((r > 0 && runs[r - 1].len <= runs[r].len + runs[r + 1].len) ||
+        (r > 1 && runs[r - 2].len <= runs[r - 1].len + runs[r].len)) {
+      if (runs[r - 1].len < runs[r + 1].len)
+        r--;
     }
-    else {
-      auxsort(L, p + 1, up, rnd);  /* call recursively for upper interval */
-      n = up - p;  /* size of smaller interval */
-      up = p - 1;  /* tail call for [lo .. p - 1]  (lower interval) */
+    else if (runs[r].len > runs[r + 1].len)
+      break;  /* invariants hold */
+    mergeat(L, runs, r, raw);
+    runs[r + 1] = runs[r + 2];
+    (*nruns)--;
+  }
+}
+
+
+static void timsort (lua_State *L, IdxT lo, IdxT up, int raw) {
+  Run runs[MAXRUNS];
+  int nruns = 0;
+  IdxT n = up - lo + 1;
+  IdxT mr = minrun(n);
+  while (lo <= up) {
+    IdxT e = countrun(L, lo, up, raw);
+    if (e - lo + 1 < mr) {  /* run too short? */
+      IdxT e2 = (up - lo + 1 < mr) ? up : lo + mr - 1;
+      binsort(L, lo, e + 1, e2, raw);
+      e = e2;
     }
-    if ((up - lo) / 128 > n) /* partition too imbalanced? */
-      rnd = l_randomizePivot();  /* try a new randomization */
-  }  /* tail call auxsort(L, lo, up, rnd) */
+    runs[nruns].base = lo;
+    runs[nruns++].len = e - lo + 1;
+    mergecollapse(L, runs, &nruns, raw);
+    lo = e + 1;
+  }
+  while (nruns > 1) {  /* merge all remaining runs */
+    int r = nruns - 2;
+    if (r > 0 && runs[r - 1].len < runs[r + 1].len)
+      r--;
+    mergeat(L, runs, r, raw);
+    runs[r + 1] = runs[r + 2];
+    nruns--;
+  }
 }
 
 
-static int sort (lua_State *L) {
+static int stablesort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (n > 1) {  /* non-trivial interval? */
+    int raw, fields;
+    lua_Integer lo = 1, up = n;
+    Typed *a;
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
-    if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
-      luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
+    if (isbulk(L, 1, 1))  /* before 'checkcomp' */
+      return bulksort(L, n, stablesort);
+    fields = checkcomp(L, 2);
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    if (fieldsort(L, n, fields, israw(L, 1)))
+      return 0;
+    unview(L, 1, &lo, &up);  /* sort a slice in its parent */
+    luaL_argcheck(L, up < INT_MAX, 1, "array too big");
+    raw = israw(L, 1);
+    if (lua_isnil(L, 2) && (a = totyped(L, 1)) != NULL &&
+        typedsort(L, a, lo, up, 1, 1))
+      return 0;
+    if (lua_isnil(L, 2) && (IdxT)n >= NATIVELIMIT &&
+        nativesort(L, 1, raw, (IdxT)lo, (IdxT)up, 1, 1))
+      return 0;
+    lua_createtable(L, (int)n, 0);  /* scratch space for merging (index 3) */
+    timsort(L, (IdxT)lo, (IdxT)up, raw);
   }
   return 0;
 }
@@ -477,251 +5158,342 @@ static int sort (lua_State *L) {
 
 /*
 ** {======================================================
-** Extensions to the official table library
+** Sorted arrays
+** (all functions take the same order argument as 'sort' and expect
+**  the arrays to be sorted by it)
 ** =======================================================
 */
 
-static int treplace (lua_State *L) {
-  lua_Integer len, tpos, start, end, start2, end2, i;
-  len = aux_getn(L, 1, TAB_RW);
-  if (lua_type(L, 2) == LUA_TNUMBER) {
-    start = luaL_checkinteger(L, 2);
-    luaL_argcheck(L, start >= 1 && start <= len+1, 2,
-                  "index out of bounds");
-    if (lua_type(L, 3) == LUA_TNUMBER) {
-      end = luaL_checkinteger(L, 3);
-      luaL_argcheck(L, end >= start-1 && end <= len, 3,
-                    "invalid end index");
-      tpos = 4;
-    } else {
-      end = start;
-      if (end > len)
-        end = len;
-      tpos = 3;
+
+/*
+** Move the order argument at index 'arg' to index 2 (where
+** 'sort_comp' expects it) after checking it.
+*/
+static void movecomp (lua_State *L, int arg) {
+  checkcomp(L, arg);
+  lua_pushvalue(L, arg);
+  lua_remove(L, arg);
+  lua_insert(L, 2);
+}
+
+
+/*
+** 'bsearch(t, v [, comp [, upper]])': the first index 'i' such that
+** 'not (t[i] < v)' (or, if 'upper' is true, such that 'v < t[i]'),
+** or 't.n+1' if there is none, plus whether 't' contains 'v'.
+*/
+static int tbsearch (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R), lo = 1, up = n, off;
+  int upper = lua_toboolean(L, 4), found = 0;
+  IdxT i;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  lua_settop(L, 3);
+  movecomp(L, 3);  /* 1: t, 2: comp, 3: v */
+  unview(L, 1, &lo, &up);
+  off = lo - 1;
+  luaL_argcheck(L, up < INT_MAX, 1, "array too big");
+  if (upper) {
+    i = upperbound(L, (IdxT)lo, (IdxT)up + 1, israw(L, 1));
+    if (i > (IdxT)lo) {  /* is 't[i-1]' equal to 'v'? */
+      aux_geti(L, 1, i - 1, israw(L, 1));
+      found = !sort_comp(L, -1, -2);
     }
-  } else {
-    start = len+1;
-    end = len;
-    tpos = 2;
   }
-  checktab(L, tpos, TAB_R);
-  start2 = luaL_optinteger(L, tpos+1, 1);
-  end2 = luaL_opt(L, luaL_checkinteger, tpos+2, check_n(L, tpos));
-  luaL_argcheck(L, end2 >= start2-1, tpos+2, "invalid end index");
-  if (end2-start2 > end-start) { /* array needs to grow */
-    lua_pushinteger(L, len+end2-start2-end+start);
-    lua_setfield(L, 1, "n");  /* t.n = number of elements */
-  }
-  if (start <= len) { /* replace values */
-    lua_Integer shift = end2-start2-end+start;
-    if (shift < 0) { /* shift to left */
-      for (i = end+1; i <= len; ++i) {
-        lua_geti(L, 1, i);
-        lua_seti(L, 1, i+shift);
-      }
-      for (i = len; i > len+shift; --i) {
-        lua_pushnil(L);
-        lua_seti(L, 1, i);
-      }
-    } else if (shift != 0) { /* shift to right */
-      for (i = len-shift+1; i <= len; ++i) {
-        lua_geti(L, 1, i);
-        lua_seti(L, 1, i+shift);
-      }
-      for (i = len-shift; i > end; --i) {
-        lua_geti(L, 1, i);
-        lua_seti(L, 1, i+shift);
-      }
+  else {
+    i = lowerbound(L, (IdxT)lo, (IdxT)up + 1, israw(L, 1));
+    if (i <= (IdxT)up) {  /* is 't[i]' equal to 'v'? */
+      aux_geti(L, 1, i, israw(L, 1));
+      found = !sort_comp(L, -2, -1);
     }
   }
-  /* copy from list2 to list1 */
-  for (i = start2; i <= end2; ++i) {
-    lua_geti(L, tpos, i);
-    lua_seti(L, 1, start+i-start2);
-  }
-  /* array must shrink */
-  if (end2-start2 < end-start) {
-    lua_pushinteger(L, len+end2-start2-end+start);
-    lua_setfield(L, 1, "n");  /* t.n = number of elements */
-  }
-  return 0;
+  lua_pushinteger(L, (lua_Integer)i - off);
+  lua_pushboolean(L, found);
+  return 2;
 }
 
 
-static void check_callable (lua_State *L, int idx) {
-  int c = 0;
-  switch (lua_type(L, idx)) {
-    case LUA_TFUNCTION:
-      c = 1;
-      break;
-    case LUA_TUSERDATA: /* fall through */
-    case LUA_TTABLE:
-      if (luaL_getmetafield(L, idx, "__call")) {
-        lua_pop(L, 1);
-        c = 1;
-      }
-      break;
-  }
-  luaL_argcheck(L, c, idx, "callable value expected");
+/*
+** 'insertsorted(t, v [, comp])': insert 'v' after all elements that
+** are not greater than it (using 'insert', which shifts the following
+** elements only once) and return its index.
+*/
+static int insertsorted (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  IdxT i;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  lua_settop(L, 3);
+  movecomp(L, 3);  /* 1: t, 2: comp, 3: v */
+  i = upperbound(L, 1, (IdxT)n + 1, israw(L, 1));
+  lua_remove(L, 2);
+  lua_pushinteger(L, (lua_Integer)i);
+  lua_insert(L, 2);  /* 1: t, 2: i, 3: v */
+  tinsert(L);
+  lua_pushinteger(L, (lua_Integer)i);
+  return 1;
 }
 
 
-LUA_KFUNCTION(tzipk) {
-  lua_Integer i = 1, j = 1, len;
-  int k, n, top;
-  (void)status;
-  switch (ctx) {
-    case 0:
-      if (lua_isnoneornil(L, 1)) {
-        lua_pushcfunction(L, pack);
-        lua_replace(L, 1);
-      } else
-        check_callable(L, 1);
-      n = lua_gettop(L)-1;
-      len = aux_getn(L, 2, TAB_R);
-      for (k = 3; k <= n+1; ++k) {
-        lua_Integer l = aux_getn(L, k, TAB_R);
-        if (l < len)
-          len = l;
-      }
-      lua_pushinteger(L, n); /* store number of arrays */
-      lua_insert(L, 2);
-      lua_pushinteger(L, 1); /* store current iteration index */
-      lua_pushvalue(L, -1); /* store current target index */
-      lua_pushinteger(L, len); /* store length on stack */
-      lua_createtable(L, 0, 1); /* result table */
-      luaL_checkstack(L, n+2+LUA_MINSTACK, "zip");
-      while (i <= len) { /* func, n, t_1, ..., t_n, i, j, len, rt */
-        lua_pushvalue(L, 1);
-        for (k = 3; k <= n+2; ++k) {
-          lua_pushvalue(L, n+3);
-          lua_gettable(L, k);
-        }
-        lua_callk(L, n, LUA_MULTRET, 1, tzipk);
-    case 1: /* func, n, t_1, ..., t_n, i, j, len, rt, r_1, ..., r_m */
-        n = lua_tointeger(L, 2);
-        i = lua_tointeger(L, n+3);
-        j = lua_tointeger(L, n+4);
-        len = lua_tointeger(L, n+5);
-        top = lua_gettop(L);
-        luaL_checkstack(L, 1, "zip");
-        for (k = n+7; k <= top; ++k) {
-          lua_pushvalue(L, k);
-          lua_rawseti(L, n+6, j++);
-        }
-        lua_settop(L, n+6); /* remove results r_1, ..., r_m */
-        lua_pushinteger(L, ++i);
-        lua_replace(L, n+3); /* update i */
-        lua_pushinteger(L, j);
-        lua_replace(L, n+4); /* update j */
-      }
+#define SO_MERGE	0
+#define SO_UNION	1
+#define SO_INTER	2
+#define SO_DIFF		3
+
+
+/*
+** Merge the sorted arrays 't1' and 't2' (at indices 1 and 3, the
+** order is at 2) into a new table. Like the set operations of the C++
+** library, 'union', 'intersect', and 'difference' treat equal elements
+** as duplicates: e.g. an element that occurs 3 times in 't1' and 2
+** times in 't2' occurs 3, 2, and 1 times in the result, respectively.
+** For 'merge' equal elements of 't1' come first.
+*/
+static int setop (lua_State *L, int op) {
+  lua_Integer n1 = aux_getn(L, 1, TAB_R), n2 = aux_getn(L, 2, TAB_R);
+  lua_Integer i = 1, j = 1, k = 0;
+  int raw1 = israw(L, 1), raw2 = israw(L, 2);
+  luaL_argcheck(L, n1 + n2 < INT_MAX, 2, "arrays too big");
+  lua_settop(L, 3);
+  movecomp(L, 3);  /* 1: t1, 2: comp, 3: t2 */
+  lua_createtable(L, (int)(op == SO_INTER ? 0 : n1 + n2), 1);  /* 4 */
+  aux_geti(L, 1, i, raw1);  /* 5: t1[i] */
+  aux_geti(L, 3, j, raw2);  /* 6: t2[j] */
+  while (i <= n1 && j <= n2) {
+    int take1, take2;  /* advance in 't1'/'t2'? */
+    if (sort_comp(L, -1, -2))  /* t2[j] < t1[i]? */
+      take1 = 0, take2 = 1;
+    else if (op == SO_MERGE || sort_comp(L, -2, -1))  /* t1[i] < t2[j]? */
+      take1 = 1, take2 = 0;
+    else  /* equal */
+      take1 = take2 = 1;
+    if (take1 && take2 ? (op == SO_UNION || op == SO_INTER)
+                       : take1 ? op != SO_INTER
+                               : (op == SO_MERGE || op == SO_UNION)) {
+      lua_pushvalue(L, take1 ? 5 : 6);
+      lua_rawseti(L, 4, ++k);
+    }
+    if (take1) {
+      aux_geti(L, 1, ++i, raw1);
+      lua_replace(L, 5);
+    }
+    if (take2) {
+      aux_geti(L, 3, ++j, raw2);
+      lua_replace(L, 6);
+    }
+  }
+  if (op != SO_INTER) {  /* copy the rest */
+    for (; i <= n1; i++) {
+      aux_geti(L, 1, i, raw1);
+      lua_rawseti(L, 4, ++k);
+    }
+    for (; j <= n2 && op != SO_DIFF; j++) {
+      aux_geti(L, 3, j, raw2);
+      lua_rawseti(L, 4, ++k);
+    }
   }
-  lua_pushinteger(L, j-1);
-  lua_setfield(L, -2, "n");
+  lua_settop(L, 4);
+  set_n(L, 4, k);
   return 1;
 }
 
-static int tzip (lua_State *L) {
-  return tzipk(L, 0, 0);
+
+static int tmerge (lua_State *L) {
+  return setop(L, SO_MERGE);
 }
 
 
-static int npairs_iterator (lua_State *L) {
-  lua_Integer n = aux_getn(L, 1, TAB_R);
-  lua_Integer i = luaL_checkinteger(L, 2);
-  if (i >= n)
-    return 0;
-  lua_pushinteger(L, ++i);
-  lua_pushvalue(L, -1);
-  lua_gettable(L, 1);
-  return 2;
+static int tunion (lua_State *L) {
+  return setop(L, SO_UNION);
 }
 
 
-static int npairs (lua_State *L) {
-  lua_Integer s;
-  (void)aux_getn(L, 1, TAB_R); /* check early */
-  s = luaL_optinteger(L, 2, 1);
-  lua_pushcfunction(L, npairs_iterator);
-  lua_pushvalue(L, 1);
-  lua_pushinteger(L, s-1);
-  return 3;
+static int intersect (lua_State *L) {
+  return setop(L, SO_INTER);
 }
 
 
-static void reverse (lua_State *L, lua_Integer a, lua_Integer b) {
-  for (; a < b; ++a, --b) {
-    lua_geti(L, -1, a);
-    lua_geti(L, -2, b);
-    lua_seti(L, -3, a);
-    lua_seti(L, -2, b);
+static int difference (lua_State *L) {
+  return setop(L, SO_DIFF);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Deduplication and grouping
+** =======================================================
+*/
+
+
+/*
+** Push the key of the value at stack index 'v': the result of the
+** function at index 2, or the value itself if there is none.
+*/
+static void pushkey (lua_State *L, int v) {
+  v = lua_absindex(L, v);
+  if (lua_isnil(L, 2))
+    lua_pushvalue(L, v);
+  else {
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, v);
+    lua_call(L, 1, 1);
   }
 }
 
 
-static int treverse (lua_State *L) {
-  lua_Integer begin, end;
-  checktab(L, 1, TAB_RW);
-  begin = luaL_optinteger(L, 2, 1);
-  end = luaL_opt(L, luaL_checkinteger, 3, check_n(L, 1));
-  lua_settop(L, 1);
-  reverse(L, begin, end);
-  return 0;
+/*
+** Remove all elements of 't' whose key (see 'pushkey') occurred
+** before, keeping the order of the others, and return the new
+** length. Keys are compared with raw equality, except that every NaN
+** is distinct. A first pass computes all keys and marks the elements
+** to keep, so an error in the key function leaves 't' untouched; the
+** kept elements are then moved forward in a single pass.
+*/
+static int unique (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW), i, w = 0;
+  int raw = israw(L, 1), seennil = 0;
+  char *keep;
+  if (!lua_isnoneornil(L, 2))
+    check_callable(L, 2);
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  lua_settop(L, 2);
+  lua_newtable(L);  /* 3: set of seen keys */
+  keep = (char *)lua_newuserdata(L, (size_t)n);  /* 4 */
+  for (i = 1; i <= n; i++) {
+    int k = 5, t;
+    aux_geti(L, 1, i, raw);  /* 5: element */
+    if (!lua_isnil(L, 2)) {
+      pushkey(L, 5);  /* 6: key */
+      k = 6;
+    }
+    t = lua_type(L, k);
+    if (t == LUA_TNIL) {
+      keep[i - 1] = !seennil;
+      seennil = 1;
+    }
+    else {
+      lua_pushvalue(L, k);
+      keep[i - 1] = (lua_rawget(L, 3) == LUA_TNIL);
+      if (keep[i - 1] && (t != LUA_TNUMBER ||  /* NaNs cannot be keys */
+                          lua_tonumber(L, k) == lua_tonumber(L, k))) {
+        lua_pushvalue(L, k);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 3);  /* seen[key] = true */
+      }
+    }
+    lua_settop(L, 4);
+  }
+  for (i = 1; i <= n; i++) {
+    if (keep[i - 1] && ++w != i) {
+      aux_geti(L, 1, i, raw);
+      aux_seti(L, 1, w, raw);
+    }
+  }
+  for (i = w + 1; i <= n; i++) {  /* clear the rest */
+    lua_pushnil(L);
+    aux_seti(L, 1, i, raw);
+  }
+  set_n(L, 1, w);
+  lua_pushinteger(L, w);
+  return 1;
 }
 
 
-static int trotate (lua_State *L) {
-  lua_Integer n, begin, end;
-  checktab(L, 1, TAB_RW);
-  n = -luaL_checkinteger(L, 2);
-  begin = luaL_optinteger(L, 3, 1);
-  end = luaL_opt(L, luaL_checkinteger, 4, check_n(L, 1));
-  if (end > begin) {
-    n %= end - begin + 1;
-    if (n < 0)
-      n += end - begin + 1;
-    if (n != 0) {
-      lua_settop(L, 1);
-      reverse(L, begin, begin+n-1);
-      reverse(L, begin+n, end);
-      reverse(L, begin, end);
+/*
+** Number the distinct non-nil keys of the elements of 't[1..n]' in
+** the order of their first occurrence: the table at index 3 maps the
+** keys to their (0-based) numbers, the table at index 4 the numbers
+** (plus 1) to the keys. Counts the elements of every key in 'cnt'
+** and, if 'grp' is not NULL, stores the key number of every element
+** (-1 for a nil key) in 'grp'. Returns the number of keys.
+*/
+static int numberkeys (lua_State *L, lua_Integer n, int raw, int *grp,
+                       int *cnt) {
+  int nkeys = 0;
+  lua_Integer i;
+  for (i = 0; i < n; i++) {
+    int g = -1;
+    aux_geti(L, 1, i + 1, raw);  /* 6: element */
+    pushkey(L, 6);  /* 7: key */
+    if (!lua_isnil(L, 7)) {
+      lua_pushvalue(L, 7);
+      if (lua_rawget(L, 3) != LUA_TNIL)
+        g = (int)lua_tointeger(L, -1);
+      else {  /* new key */
+        g = nkeys++;
+        cnt[g] = 0;
+        lua_pushvalue(L, 7);
+        lua_pushinteger(L, g);
+        lua_rawset(L, 3);
+        lua_pushvalue(L, 7);
+        lua_rawseti(L, 4, g + 1);
+      }
+      cnt[g]++;
     }
+    if (grp != NULL)
+      grp[i] = g;
+    lua_settop(L, 5);
   }
-  return 0;
+  return nkeys;
 }
 
 
-/* try to guess which PRNG Lua uses */
-#if !defined(l_rand)
-#if defined(unix) || defined(__unix) || defined(__unix__) || \
-    (defined(__APPLE__) && defined(__MACH__)) || \
-    HAVE_UNISTD_H
-#include <unistd.h>
-#endif
-#if defined(_POSIX_VERSION)
-#define l_rand()   random()
-#define L_RANDMAX  2147483647
-#else
-#define l_rand()   rand()
-#define L_RANDMAX  RAND_MAX
-#endif
-#endif
+/* set up the stack for 'numberkeys' with a buffer of 'm' ints */
+static int *keybuffer (lua_State *L, lua_Integer n, size_t m) {
+  check_callable(L, 2);
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  lua_settop(L, 2);
+  lua_newtable(L);  /* 3: key numbers */
+  lua_newtable(L);  /* 4: keys */
+  return (int *)lua_newuserdata(L, m * sizeof(int));  /* 5 */
+}
 
-static int tshuffle (lua_State *L) {
-  lua_Integer begin, end;
-  checktab(L, 1, TAB_RW);
-  begin = luaL_optinteger(L, 2, 1);
-  end = luaL_opt(L, luaL_checkinteger, 3, check_n(L, 1));
-  while (end >= begin) {
-    double f = l_rand() * (1.0/(L_RANDMAX+1.0));
-    lua_Integer j = begin + (lua_Integer)(f * (end-begin+1));
-    lua_geti(L, 1, end);
-    lua_geti(L, 1, j);
-    lua_seti(L, 1, end);
-    lua_seti(L, 1, j);
-    --end;
+
+/* return a table that maps every key to its number of elements */
+static int countby (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R);
+  int *cnt = keybuffer(L, n, (size_t)n);
+  int g, nkeys = numberkeys(L, n, israw(L, 1), NULL, cnt);
+  lua_createtable(L, 0, nkeys);  /* 6: result */
+  for (g = 0; g < nkeys; g++) {
+    lua_rawgeti(L, 4, g + 1);
+    lua_pushinteger(L, cnt[g]);
+    lua_rawset(L, 6);
   }
-  return 0;
+  return 1;
+}
+
+
+/*
+** Return a table that maps every key to the array (with '.n') of its
+** elements in their original order. The elements are counted first,
+** so every array is created with its final size.
+*/
+static int groupby (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_R), i;
+  int raw = israw(L, 1);
+  int *grp = keybuffer(L, n, 2 * (size_t)n), *cnt = grp + n;
+  int g, nkeys = numberkeys(L, n, raw, grp, cnt);
+  lua_createtable(L, 0, nkeys);  /* 6: result */
+  for (g = 0; g < nkeys; g++) {
+    lua_rawgeti(L, 4, g + 1);  /* key */
+    lua_createtable(L, cnt[g], 1);
+    set_n(L, -1, cnt[g]);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 4, g + 1);  /* from now on table 4 holds the groups */
+    lua_rawset(L, 6);
+    cnt[g] = 0;
+  }
+  for (i = 0; i < n; i++) {
+    if ((g = grp[i]) >= 0) {
+      lua_rawgeti(L, 4, g + 1);
+      aux_geti(L, 1, i + 1, raw);
+      lua_rawseti(L, -2, ++cnt[g]);
+      lua_pop(L, 1);
+    }
+  }
+  return 1;
 }
 
 /* }====================================================== */
@@ -730,21 +5502,52 @@ static int tshuffle (lua_State *L) {
 
 static const luaL_Reg tab_funcs[] = {
   {"concat", tconcat},
+  {"writeconcat", writeconcat},
 #if defined(LUA_COMPAT_MAXN)
   {"maxn", maxn},
 #endif
   {"insert", tinsert},
   {"pack", pack},
+  {"pack_into", pack_into},
   {"unpack", unpack},
   {"remove", tremove},
   {"move", tmove},
   {"sort", sort},
+  {"stablesort", stablesort},
+  {"sortby", sortby},
+  {"sortperm", sortperm},
+  {"select", tselect},
+  {"partialsort", partialsort},
+  {"topk", topk},
+  {"permute", permute},
   {"replace", treplace},
+  {"extend", extend},
   {"zip", tzip},
-  {"npairs", npairs},
+  {"zip_into", tzip_into},
+  {"iter", iter},
+  {"new", tnew},
+  {"range", range},
   {"reverse", treverse},
   {"rotate", trotate},
   {"shuffle", tshuffle},
+  {"sample", sample},
+  {"bsearch", tbsearch},
+  {"insertsorted", insertsorted},
+  {"merge", tmerge},
+  {"union", tunion},
+  {"intersect", intersect},
+  {"difference", difference},
+  {"unique", unique},
+  {"groupby", groupby},
+  {"countby", countby},
+  {"sum", sum},
+  {"mean", mean},
+  {"minmax", minmax},
+  {"argmax", argmax},
+  {"dot", dot},
+  {"deque", deque},
+  {"typed", typed},
+  {"slice", slice},
   {NULL, NULL}
 };
 
@@ -758,9 +5561,22 @@ static const luaL_Reg tab_funcs[] = {
 #endif
 
 TABLE_N_API int luaopen_table_n (lua_State *L) {
-  luaL_newlib(L, tab_funcs);
+  luaL_checkversion(L);
+  luaL_newlibtable(L, tab_funcs);
+  lua_pushliteral(L, "n");  /* 'NKEY' upvalue */
+  luaL_setfuncs(L, tab_funcs, 1);
+  createdequemeta(L);
+  createtypedmeta(L);
+  createviewmeta(L);
+  createpipemeta(L);
+  /* npairs also keeps its (stateless) iterator as second upvalue */
+  lua_pushliteral(L, "n");
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, npairs_iterator, 1);
+  lua_pushcclosure(L, npairs, 2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, "npairs");
   /* _G.npairs = table.npairs */
-  lua_getfield(L, -1, "npairs");
   lua_setglobal(L, "npairs");
   return 1;
 }
@@ -50,6 +50,9 @@ p( t5 )
 print( "table.concat() ..." )
 print( table.concat( t1, ", ", 1, 1 ) )
 print( table.concat( t4, ", " ) )
+print( table.concat( table.pack( 1, -20, 3.0, -0.0, 0.5, 1e100, 1e15,
+                                math.mininteger, "x" ), " " ) )
+print( pcall( table.concat, t5 ) )
 
 
 print( "table.insert() ..." )
@@ -59,6 +62,11 @@ p( t2 )
 table.insert( t3, 1 )
 table.insert( t3, 2, 2 )
 p( t3 )
+table.insert( t5, 3, "a", nil, "b" )
+p( t5 )
+table.insert( t4, 2, "x", "y" )
+p( t4 )
+print( pcall( table.insert, t4, 5, "z", "z" ) )
 reset()
 
 
@@ -87,6 +95,14 @@ table.remove( t5, 2 )
 table.remove( t5, 1 )
 p( t5 )
 reset()
+print( table.remove( t5, 2, 4 ) )
+p( t5 )
+print( t5.n, table.remove( t5, 2, 1 ) )
+print( table.remove( t5, 1, t5.n ) )
+print( t5.n, t5[ 1 ] )
+print( pcall( table.remove, t4, 1, 2 ) )
+print( pcall( table.remove, t4, 3, 3 ) )
+reset()
 
 
 print( "table.sort() ..." )
@@ -97,6 +113,177 @@ p( t3 )
 table.sort( t5 )
 p( t5 )
 reset()
+local t = table.pack( 5, 3, nil, 9, 1, 7, 2, 8, nil, 6, 4, 0, -11, 15,
+                      13, 12, 14, 10 )
+table.sort( t )
+p( t )
+t = table.pack( 0.5, 3.5, nil, 9.5, -1.5, 7.5, 2.5, 8.5, nil, 6.5, 4.5,
+                -0.5, 11.5, 15.5, 13.5, 12.5, 14.5, 10.5 )
+table.sort( t )
+p( t )
+t = table.pack( "e", "c", nil, "i", "a", "g", "b", "h", nil, "f", "d",
+                "", "k", "o", "m", "l", "n", "j", "a\0b", "a\0a" )
+table.sort( t )
+print( (table.concat( t, ",", 1, t.n-2 ):gsub( "%z", "\\0" )) )
+local big1, big2 = { n = 150000 }, { n = 150000 }
+for i = 1, big1.n do
+  big1[ i ] = (i * 7919) % 65521 - 30000
+  big2[ i ] = big1[ i ]
+end
+table.sort( big1 )
+table.sort( big2, nil, { threads = 4 } )
+local same = true
+for i = 1, big1.n do
+  if big1[ i ] ~= big2[ i ] then same = false end
+end
+print( same )
+local function gt( a, b ) return a > b end
+local ok = true
+for _, f in ipairs{ function( i ) return i end,
+                    function( i ) return -i end,
+                    function( i ) return i % 3 end,
+                    function( i ) return math.min( i, 300-i ) end } do
+  t = { n = 300 }
+  for i = 1, t.n do t[ i ] = f( i ) end
+  table.sort( t, gt )
+  for i = 2, t.n do
+    if t[ i ] > t[ i-1 ] then ok = false end
+  end
+end
+print( ok )
+print( pcall( table.sort, t, function() return true end ) )
+t = table.pack( 5, 2, nil, 4, 1, 3 )
+local co = coroutine.wrap( function()
+  table.sort( t, nil, { budget = 2 } )
+  return "done"
+end )
+local yields = 0
+while co() ~= "done" do yields = yields + 1 end
+print( yields )
+p( t )
+t = table.pack( "b1", "a1", "b2", "a2" )
+co = coroutine.wrap( function()
+  table.sort( t, function( a, b )
+    coroutine.yield()
+    return a:sub( 1, 1 ) < b:sub( 1, 1 )
+  end, { budget = 100 } )
+  return "done"
+end )
+yields = 0
+while co() ~= "done" do yields = yields + 1 end
+print( yields, table.concat( t, " " ) )
+print( pcall( table.sort, t, nil, { budget = 0 } ) )
+local people = table.pack(
+  { last = "b", first = "y", score = 3 }, { last = "a", first = "z", score = 1 },
+  { last = "b", first = "x", score = 2 }, { last = "a", first = "x", score = 3 } )
+local function names( t )
+  local s = { n = t.n }
+  for i = 1, t.n do s[ i ] = t[ i ].last .. t[ i ].first .. t[ i ].score end
+  print( table.concat( s, " " ) )
+end
+table.sort( people, { "last", "first" } )
+names( people )
+table.sort( people, { "score", "last", desc = { true } } )
+names( people )
+t = { n = 20 }
+for i = 1, t.n do t[ i ] = { score = (i * 7) % 10, id = i } end
+table.sort( t, { "score", desc = true } )
+print( t[ 1 ].score, t[ 1 ].id, t[ 2 ].id, t[ 20 ].score, t[ 20 ].id )
+print( pcall( table.sort, people, {} ) )
+print( pcall( table.sort, people, true ) )
+
+
+print( "table.stablesort() ..." )
+local recs = table.pack( "b1", "a1", "c1", "b2", "a2", "c2", "b3", "a3" )
+local function first( a, b ) return a:sub( 1, 1 ) < b:sub( 1, 1 ) end
+table.stablesort( recs, first )
+p( recs )
+table.stablesort( recs, function( a, b ) return b < a end )
+p( recs )
+table.stablesort( t5 )
+p( t5 )
+reset()
+t = { n = 200 }
+for i = 1, t.n do t[ i ] = ("%03d"):format( (i * 37) % 100 ) .. i end
+table.stablesort( t, first )
+print( t[ 1 ], t[ 2 ], t[ 3 ], t[ 100 ], t[ 101 ], t[ 200 ] )
+print( pcall( table.stablesort, t1 ) )
+
+
+print( "table.sortby() ..." )
+recs = table.pack( "b1", "a1", "c1", "b2", "a2", "c2", "b3", "a3" )
+local calls = 0
+local function initial( s ) calls = calls + 1; return s:sub( 1, 1 ) end
+table.sortby( recs, initial )
+p( recs )
+print( calls )
+table.sortby( recs, initial, true )
+p( recs )
+t = table.pack( -3, 1.5, 2, nil, -0.5, 0 )
+table.sortby( t, function( v ) return v and -v end )
+p( t )
+print( pcall( table.sortby, recs, function( s ) return s < "b" and 1 or s end ) )
+p( recs )
+
+
+print( "table.select() ..." )
+local function scrambled( n )
+  local t = { n = n }
+  for i = 1, n do t[ i ] = (i * 37) % n + 1 end
+  return t
+end
+t = scrambled( 100 )
+print( table.select( t, 30 ), t[ 30 ] )
+ok = true
+for i = 1, 29 do ok = ok and t[ i ] < 30 end
+for i = 31, 100 do ok = ok and t[ i ] > 30 end
+print( ok )
+print( table.select( t, 1, function( a, b ) return a > b end ) )
+print( pcall( table.select, t, 101 ) )
+print( pcall( table.select, t2, 1 ) )
+
+
+print( "table.partialsort() ..." )
+t = scrambled( 100 )
+table.partialsort( t, 5 )
+print( t[ 1 ], t[ 2 ], t[ 3 ], t[ 4 ], t[ 5 ], t[ 6 ] > 5 )
+table.partialsort( t, 3, function( a, b ) return a > b end )
+print( t[ 1 ], t[ 2 ], t[ 3 ] )
+t = table.pack( 3, nil, 1, 2 )
+table.partialsort( t, 10 )
+p( t )
+print( pcall( table.partialsort, t, 0 ) )
+
+
+print( "table.topk() ..." )
+t = scrambled( 100 )
+local top = table.topk( t, 5 )
+p( top )
+print( top.n, t[ 1 ], t[ 2 ] )
+p( table.topk( t, 3, function( a, b ) return a > b end ) )
+names( table.topk( people, 2, { "score", desc = true } ) )
+print( table.topk( t, 0 ).n, table.topk( t4, 5 ).n )
+print( pcall( table.topk, t, -1 ) )
+print( pcall( table.topk, t, 1, 1 ) )
+
+print( "table.sortperm() ..." )
+t = table.pack( 30, 10, nil, 20, 10 )
+local perm = table.sortperm( t )
+p( perm )
+print( perm.n )
+p( table.sortperm( t, function( a, b ) return a > b end ) )
+p( table.sortperm( people, { "score", "first", desc = true } ) )
+p( t )
+print( pcall( table.sortperm, t1 ) )
+
+
+print( "table.permute() ..." )
+local ids = table.pack( "c", "a", "d", "b", "e" )
+table.permute( perm, t, ids )
+p( t )
+p( ids )
+print( pcall( table.permute, table.pack( 1, 1 ), table.pack( 1, 2 ) ) )
+print( pcall( table.permute, perm, table.pack( 1, 2 ) ) )
 
 
 print( "table.replace() ..." )
@@ -130,6 +317,16 @@ p( t5 )
 reset()
 
 
+print( "table.extend() ..." )
+x = table.pack( 1, 2 )
+print( table.extend( x, t5, t4, x ) == x )
+p( x )
+print( x.n )
+print( pcall( table.extend, x, t5, {} ) )
+print( x.n )
+reset()
+
+
 print( "table.zip() ..." )
 local function is_nil( v )
   if v == nil then return nil end
@@ -153,6 +350,287 @@ for i = 1, x.n do
   p( x[ i ] )
 end
 
+local function ifodd( v ) if v % 2 == 1 then return v, v end end
+x = table.zip( ifodd, table.pack( 1, 3, 4, 5 ) )
+print( x.n, table.concat( x, " " ) )
+local function firstmany( v )
+  if v == 1 then return table.unpack( table.range( 1, 20000 ) ) end
+end
+print( table.zip( firstmany, table.range( 1, 100000 ) ).n )
+
+
+print( "table.zip_into() ..." )
+x = table.pack( 9, 9, 9, 9, 9, 9, 9, 9 )
+print( table.zip_into( x, id, t5, t4 ) == x )
+print( x.n, x[ 1 ], x[ 2 ], x[ 3 ], x[ 4 ] )
+table.zip_into( x, nil, t4 )
+print( x.n, x[ 1 ].n, x[ 1 ][ 1 ], x[ 2 ] )
+print( pcall( table.zip_into, 1, id, t4 ) )
+
+
+print( "table.pack_into() ..." )
+x = table.pack( 1, 2, 3, 4 )
+print( table.pack_into( x, "a", nil ) == x )
+p( x, 1, 4 )
+print( x.n )
+table.pack_into( x )
+p( x, 1, 4 )
+print( x.n )
+print( pcall( table.pack_into, nil, 1 ) )
+
+print( "table.new() ..." )
+x = table.new( 3 )
+print( x.n, x[ 1 ], x[ 3 ] )
+x = table.new( 3, 2, "z" )
+print( x.n, table.concat( x, "" ) )
+print( table.new( 0 ).n )
+print( pcall( table.new, -1 ) )
+print( pcall( table.new, 1, -1 ) )
+
+
+print( "table.range() ..." )
+p( table.range( 1, 5 ) )
+p( table.range( 5, 1, -2 ) )
+p( table.range( 0, 1, 0.25 ) )
+print( table.range( 5, 1 ).n, table.range( 1, 1 ).n )
+p( table.range( 1, 3.5 ) )
+p( table.range( 3, 1.5, -1 ) )
+p( table.range( math.maxinteger - 2, math.maxinteger ) )
+print( pcall( table.range, 1, 5, 0 ) )
+print( pcall( table.range, 1 ) )
+
+print( "table.deque() ..." )
+x = table.deque( t5 )
+print( x.n, #x )
+p( x )
+table.insert( x, 1, "a" )
+table.insert( x, "b" )
+x:pushfront( "c", "d" )
+x:push( "e" )
+p( x )
+print( table.remove( x, 1 ), x:pop(), x:popfront(), x.n )
+table.sort( x, function( a, b ) return tostring( a ) < tostring( b ) end )
+p( x )
+x.n = x.n + 1
+x[ x.n + 1 ] = "f"
+x.n = x.n - 1
+p( x )
+print( pcall( function() x.y = 1 end ) )
+print( pcall( function() x[ x.n + 2 ] = 1 end ) )
+x = table.pack_into( table.deque(), "a", "b", "c" )
+table.extend( x, table.pack( nil, 1 ) )
+p( x )
+x = table.zip_into( table.deque(), function( a ) return a end,
+                    table.pack( nil, 2 ) )
+print( x.n, x[ 1 ], x[ 2 ] )
+x = table.deque()
+print( x.n, x:pop(), table.remove( x ), x.n )
+
+print( "table.typed() ..." )
+x = table.typed( "i64", 3 )
+print( x.n, #x, x[ 1 ], x[ 4 ] )
+x = table.typed( "f64", table.pack( 3, 1, 2 ) )
+table.insert( x, 1, 5, 4 )
+p( x )
+table.sort( x )
+table.rotate( x, 1 )
+p( x )
+print( table.remove( x, 2, 3 ) )
+table.move( x, 1, 3, 2 )
+p( x )
+table.replace( x, 1, 1, table.typed( "f64", table.pack( 7, 8 ) ) )
+table.reverse( x )
+p( x )
+x = table.typed( "bool", table.pack( true, nil, 1 ) )
+x.n = 4
+p( x )
+print( pcall( function() x[ 6 ] = true end ) )
+x = table.pack_into( table.typed( "f64" ), 1, 2, 3 )
+table.extend( x, x )
+p( x )
+p( table.zip_into( table.typed( "i64" ), math.max, x, table.pack( 2, 2 ) ) )
+print( pcall( table.insert, table.typed( "u8" ), 256 ) )
+print( pcall( table.insert, table.typed( "i64" ), 1, 1.5 ) )
+print( pcall( table.typed, "i32" ) )
+
+print( "table.slice() ..." )
+x = table.pack( 5, 4, 3, 2, 1 )
+local y = table.slice( x, 2, 4 )
+print( y.n, #y, y[ 1 ], y[ 4 ] )
+table.sort( y )
+p( x )
+table.reverse( table.slice( y, 2 ) )
+p( x )
+y[ 1 ] = "a"
+print( table.concat( y, "," ), table.unpack( y ) )
+print( table.move( y, 1, 2, 2 ) == y )
+p( x )
+print( pcall( table.insert, y, 1 ) )
+print( pcall( table.slice, x, 2, 6 ) )
+
+print( "__getrange/__setrange ..." )
+do
+  local store, ncalls = table.range( 1, 200 ), 0
+  local proxy = setmetatable( {}, {
+    __index = store,
+    __newindex = store,
+    __getrange = function( _, i, j )
+      ncalls = ncalls + 1
+      return table.unpack( store, i, j )
+    end,
+    __setrange = function( _, i, ... )
+      ncalls = ncalls + 1
+      table.move( table.pack( ... ), 1, select( "#", ... ), i, store )
+    end,
+  } )
+  table.insert( proxy, 1, 0 )
+  print( store.n, store[ 1 ], store[ 2 ], store[ 201 ], ncalls )
+  ncalls = 0
+  table.sort( proxy, function( a, b ) return a > b end )
+  print( store[ 1 ], store[ 201 ], ncalls )
+  ncalls = 0
+  print( #table.concat( proxy, "," ), select( "#", table.unpack( proxy ) ),
+         ncalls )
+  print( table.remove( proxy, 1, 3 ) )
+  print( store.n, store[ 1 ], store[ 198 ], store[ 199 ] )
+  for i = 1, store.n do
+    store[ i ] = { a = i % 3, b = i }
+  end
+  table.sort( proxy, { "a", "b", desc = true } )
+  print( store[ 1 ].a, store[ 1 ].b, store[ store.n ].a, store[ store.n ].b )
+  table.stablesort( proxy, { "b", desc = true } )
+  print( store[ 1 ].b, store[ store.n ].b )
+end
+
+print( "table.writeconcat() ..." )
+do
+  local chunks = table.pack()
+  local function writer( s )
+    table.insert( chunks, s )
+  end
+  print( table.writeconcat( writer, t5, ",", 2, 2 ), chunks.n )
+  x = table.pack( 1, 2.5, "x" )
+  print( table.writeconcat( writer, x, ", " ), table.concat( chunks ) )
+  print( table.writeconcat( io.stdout, x, "-", 2 ) )
+  print( pcall( table.writeconcat, writer, t5 ) )
+  print( pcall( table.writeconcat, {}, x ) )
+end
+
+print( "table.sum()/mean()/minmax()/argmax()/dot() ..." )
+do
+  local nums = table.pack( 3, 1.5, -2, 7, 7, 0.25 )
+  print( table.sum( nums ), table.sum( nums, 2, 3 ), table.mean( nums ) )
+  print( table.minmax( nums ) )
+  print( table.argmax( nums ) )
+  print( table.sum( table.pack( 1, 2, 3 ) ), table.sum( table.pack() ),
+         table.mean( table.pack() ), table.minmax( table.pack() ) )
+  print( pcall( table.sum, table.pack( 1, nil, 3 ) ) )
+  print( table.sum( table.pack( 1, nil, 3 ), 1, 3, true ),
+         table.mean( table.pack( 1, nil, 3 ), 1, 3, true ) )
+  print( pcall( table.minmax, table.pack( 1, "2" ) ) )
+  local a = table.typed( "i64", table.pack( 4, 9, 1, 9 ) )
+  print( table.sum( a ), table.argmax( a ) )
+  print( table.minmax( table.slice( a, 3 ) ) )
+  print( table.dot( a, a ),
+         table.dot( table.pack( 1, 2.5 ), table.pack( 2, 2 ) ) )
+  print( pcall( table.dot, a, table.pack( 1 ) ) )
+  local big = table.new( 10, 0, 1700000000000000000 )
+  print( table.mean( big ) == 1.7e18,
+         table.mean( table.pack( math.maxinteger, math.maxinteger ) ) > 0,
+         table.mean( table.typed( "i64", big ) ) == 1.7e18 )
+  print( table.sum( table.pack( math.maxinteger, 1 ) ) == math.mininteger,
+         table.sum( table.pack( math.maxinteger, 1, 0.5 ) ) > 0,
+         table.sum( table.pack( 0.5, math.mininteger, -1 ) ) < 0 )
+end
+
+print( "table.iter() ..." )
+do
+  local nums = table.range( 1, 10 )
+  local ncalls = 0
+  local function sq( v ) ncalls = ncalls + 1 return v*v end
+  local function even( v ) return v % 2 == 0 end
+  local function add( a, b ) return a+b end
+  local it = table.iter( nums )
+  p( it:map( sq ):filter( even ):collect() )
+  ncalls = 0
+  p( it:map( sq ):take( 3 ):collect() )
+  print( ncalls, it:take( 0 ):collect().n )
+  print( it:reduce( add ), it:filter( even ):reduce( add, 100 ),
+         table.iter( table.pack() ):reduce( add ) )
+  p( table.iter( nums, 4, 6 ):collect() )
+  local co = coroutine.wrap( function()
+    return table.iter( nums, 1, 3 ):map( function( v )
+      coroutine.yield( v )
+      return -v
+    end ):reduce( add )
+  end )
+  print( co(), co(), co(), co() )
+  print( pcall( it.map, it, 1 ) )
+  print( pcall( it.take, it, -1 ) )
+end
+
+print( "table.sample() ..." )
+do
+  local a, b = table.range( 1, 10 ), table.range( 1, 10 )
+  table.shuffle( a, 1, 10, 42 )
+  table.shuffle( b, nil, nil, 42 )
+  print( table.concat( a, "," ), table.concat( b, "," ) )
+  local s = table.sample( a, 4, 7 )
+  p( s )
+  print( table.concat( table.sample( a, 4, 7 ), "," ) )
+  s = table.sample( a, 10 )
+  table.sort( s )
+  print( table.concat( s, "," ), table.sample( a, 0 ).n )
+  print( pcall( table.sample, a, 11 ) )
+end
+
+print( "table.bsearch()/insertsorted()/merge() ..." )
+do
+  local sorted = table.pack( 1, 3, 3, 5 )
+  print( table.bsearch( sorted, 3 ) )
+  print( table.bsearch( sorted, 3, nil, true ) )
+  print( table.bsearch( sorted, 4 ) )
+  print( table.bsearch( sorted, 6 ) )
+  local desc = table.pack( 5, 3, 1 )
+  local function gt( a, b ) return a > b end
+  print( table.bsearch( desc, 3, gt ) )
+  print( table.insertsorted( desc, 4, gt ), table.concat( desc, "," ) )
+  print( table.insertsorted( sorted, 3 ), table.concat( sorted, "," ) )
+  local a, b = table.pack( 1, 2, 2, 4 ), table.pack( 2, 3, 4, 4 )
+  p( table.merge( a, b ) )
+  p( table.union( a, b ) )
+  p( table.intersect( a, b ) )
+  p( table.difference( a, b ) )
+  print( pcall( table.merge, a, b, 1 ) )
+end
+
+print( "table.unique()/groupby()/countby() ..." )
+do
+  local ids = table.pack( 3, 1, 3, 2, 1, nil, 2.0, nil )
+  print( table.unique( ids ) )
+  p( ids )
+  local words = table.pack( "apple", "banana", "avocado", "cherry", "bean" )
+  local function first( s ) return s:sub( 1, 1 ) end
+  local u = table.pack( table.unpack( words ) )
+  print( table.unique( u, first ) )
+  p( u )
+  local g = table.groupby( words, first )
+  p( g.a )
+  p( g.b )
+  p( g.c )
+  local c = table.countby( words, first )
+  print( c.a, c.b, c.c, c.d )
+  print( pcall( table.groupby, words ) )
+  u = table.pack( 1, 1, 2, 3, 4 )
+  print( pcall( table.unique, u, function( v )
+    return v < 4 and v or error( "no key" )
+  end ) )
+  p( u )
+  local callable = setmetatable( {}, { __call = function( _, s )
+    return first( tostring( s ) )
+  end } )
+  print( table.countby( words, callable ).a, table.unique( u, callable ) )
+end
 
 print( "table.npairs() ..." )
 for i,v in table.npairs( t3 ) do
@@ -161,6 +639,14 @@ end
 for i,v in table.npairs( t5, 2 ) do
   print( i, v )
 end
+for i,v in table.npairs( t5, 2, true ) do
+  print( i, v )
+end
+local t = table.pack( 1, 2, 3 )
+for i,v in table.npairs( t, 1, true ) do
+  table.insert( t, v )
+end
+p( t )
 
 
 print( "table.reverse() ..." )